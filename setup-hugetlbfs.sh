@@ -1,6 +1,7 @@
 #!/bin/bash
 mkdir -p /mnt/huge
-(mount | grep /mnt/huge) > /dev/null || mount -t hugetlbfs hugetlbfs /mnt/huge
+mount | grep -q ' /mnt/huge ' || mount -t hugetlbfs hugetlbfs /mnt/huge
+# reserve pages on every NUMA node, ixy allocates DMA memory on the node the NIC is attached to
 for i in {0..7}
 do
 	if [[ -e "/sys/devices/system/node/node$i" ]]
@@ -8,3 +9,15 @@ do
 		echo 512 > /sys/devices/system/node/node$i/hugepages/hugepages-2048kB/nr_hugepages
 	fi
 done
+# optional 1 GB pages for physically contiguous DMA memory larger than 2 MB
+# without them ixy searches for adjacent 2 MB pages which might fail on a fragmented system
+# 1 GB pages can usually only be reserved early after boot, set NUM_1G_PAGES to reserve some
+if [[ -e /sys/kernel/mm/hugepages/hugepages-1048576kB ]]
+then
+	mkdir -p /mnt/huge-1G
+	mount | grep -q ' /mnt/huge-1G ' || mount -t hugetlbfs -o pagesize=1G hugetlbfs /mnt/huge-1G
+	if [[ -n "$NUM_1G_PAGES" ]]
+	then
+		echo "$NUM_1G_PAGES" > /sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages
+	fi
+fi
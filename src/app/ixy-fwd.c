@@ -19,9 +19,7 @@ static void forward(struct ixy_device* rx_dev, uint16_t rx_queue, struct ixy_dev
 		uint32_t num_tx = ixy_tx_batch(tx_dev, tx_queue, bufs, num_rx);
 		// there are two ways to handle the case that packets are not being sent out:
 		// either wait on tx or drop them; in this case it's better to drop them, otherwise we accumulate latency
-		for (uint32_t i = num_tx; i < num_rx; i++) {
-			pkt_buf_free(bufs[i]);
-		}
+		pkt_buf_free_batch(bufs + num_tx, num_rx - num_tx);
 	}
 }
 
@@ -34,6 +32,9 @@ int main(int argc, char* argv[]) {
 
 	struct ixy_device* dev1 = ixy_init(argv[1], 1, 1);
 	struct ixy_device* dev2 = ixy_init(argv[2], 1, 1);
+	// bufs sent out on one port were received on the other one, give them back directly (if supported by the drivers)
+	ixy_enable_recycling(dev1, 0, dev2, 0);
+	ixy_enable_recycling(dev2, 0, dev1, 0);
 
 	uint64_t last_stats_printed = monotonic_time();
 	struct device_stats stats1, stats1_old;
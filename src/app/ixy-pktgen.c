@@ -44,25 +44,19 @@ static uint16_t calc_ip_checksum(uint8_t* data, uint32_t len) {
 	return ~((uint16_t) cs);
 }
 
-static struct mempool* init_mempool() {
+// called once for each buf when the mempool is created
+static void init_pkt_buf(struct pkt_buf* buf, void* arg) {
+	(void) arg;
+	buf->size = PKT_SIZE;
+	memcpy(buf->data, pkt_data, sizeof(pkt_data));
+	*(uint16_t*) (buf->data + 24) = calc_ip_checksum(buf->data + 14, 20);
+}
+
+static struct mempool* init_mempool(int numa_node) {
 	const int NUM_BUFS = 2048;
-	struct mempool* mempool = memory_allocate_mempool(NUM_BUFS, 0);
 	// pre-fill all our packet buffers with some templates that can be modified later
 	// we have to do it like this because sending is async in the hardware; we cannot re-use a buffer immediately
-	struct pkt_buf* bufs[NUM_BUFS];
-	for (int buf_id = 0; buf_id < NUM_BUFS; buf_id++) {
-		struct pkt_buf* buf = pkt_buf_alloc(mempool);
-		buf->size = PKT_SIZE;
-		memcpy(buf->data, pkt_data, sizeof(pkt_data));
-		*(uint16_t*) (buf->data + 24) = calc_ip_checksum(buf->data + 14, 20);
-		bufs[buf_id] = buf;
-	}
-	// return them all to the mempool, all future allocations will return bufs with the data set above
-	for (int buf_id = 0; buf_id < NUM_BUFS; buf_id++) {
-		pkt_buf_free(bufs[buf_id]);
-	}
-
-	return mempool;
+	return memory_allocate_mempool_init(NUM_BUFS, 0, numa_node, init_pkt_buf, NULL);
 }
 
 int main(int argc, char* argv[]) {
@@ -71,8 +65,9 @@ int main(int argc, char* argv[]) {
 		return 1;
 	}
 
-	struct mempool* mempool = init_mempool();
 	struct ixy_device* dev = ixy_init(argv[1], 1, 1);
+	// keep packet buffers local to the NIC
+	struct mempool* mempool = init_mempool(dev->numa_node);
 
 	uint64_t last_stats_printed = monotonic_time();
 	uint64_t counter = 0;
@@ -88,13 +83,20 @@ int main(int argc, char* argv[]) {
 	while (true) {
 		// we cannot immediately recycle packets, we need to allocate new packets every time
 		// the old packets might still be used by the NIC: tx is async
-		pkt_buf_alloc_batch(mempool, bufs, BATCH_SIZE);
-		for (uint32_t i = 0; i < BATCH_SIZE; i++) {
+		// this may return fewer bufs than requested if the nic still holds most of the pool
+		uint32_t num_bufs = pkt_buf_alloc_batch(mempool, bufs, BATCH_SIZE);
+		for (uint32_t i = 0; i < num_bufs; i++) {
+			// only the sequence number is changed below, so the template is still there unless someone else wrote the buf
+			if (bufs[i]->flags & PKT_BUF_DIRTY) {
+				init_pkt_buf(bufs[i], NULL);
+				bufs[i]->flags &= ~PKT_BUF_DIRTY;
+			}
 			// packets can be modified here, make sure to update the checksum when changing the IP header
+			// set PKT_BUF_DIRTY if you change more than the sequence number
 			*(uint32_t*)(bufs[i]->data + PKT_SIZE - 4) = seq_num++;
 		}
 		// the packets could be modified here to generate multiple flows
-		ixy_tx_batch_busy_wait(dev, 0, bufs, BATCH_SIZE);
+		ixy_tx_batch_busy_wait(dev, 0, bufs, num_bufs);
 
 		// don't check time for every packet, this yields +10% performance :)
 		if ((counter++ & 0xFFF) == 0) {
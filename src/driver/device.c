@@ -3,7 +3,7 @@
 #include "driver/virtio.h"
 #include "pci.h"
 
-struct ixy_device* ixy_init(const char* pci_addr, uint16_t rx_queues, uint16_t tx_queues) {
+static bool is_virtio(const char* pci_addr) {
 	// Read PCI configuration space
 	int config = pci_open_resource(pci_addr, "config");
 	uint16_t vendor_id = read_io16(config, 0);
@@ -13,10 +13,86 @@ struct ixy_device* ixy_init(const char* pci_addr, uint16_t rx_queues, uint16_t t
 	if (class_id != 2) {
 		error("Device %s is not a NIC", pci_addr);
 	}
-	if (vendor_id == 0x1af4 && device_id >= 0x1000) {
-		return virtio_init(pci_addr, rx_queues, tx_queues);
+	return vendor_id == 0x1af4 && device_id >= 0x1000;
+}
+
+struct ixy_device* ixy_init(const char* pci_addr, uint16_t rx_queues, uint16_t tx_queues) {
+	struct ixy_device* dev;
+	bool virtio = is_virtio(pci_addr);
+	if (virtio) {
+		dev = virtio_init(pci_addr, rx_queues, tx_queues);
 	} else {
 		// Our best guess is to try ixgbe
-		return ixgbe_init(pci_addr, rx_queues, tx_queues);
+		dev = ixgbe_init(pci_addr, rx_queues, tx_queues);
+	}
+	static uint8_t next_port_id;
+	dev->port_id = next_port_id++;
+	debug("%u huge pages in use for DMA memory", memory_huge_pages_in_use());
+	// secondary processes find the device by its pci address (virtio devices can't be shared)
+	if (memory_share_is_primary() && !virtio) {
+		memory_share_publish(pci_addr, dev);
+	}
+	return dev;
+}
+
+// secondary processes in shared memory mode (see memory_share_attach) use this instead of ixy_init
+// the device was initialized by the primary process and isn't touched here
+// each queue must only be used by one process, the primary shouldn't use the queues assigned to secondaries
+struct ixy_device* ixy_attach(const char* pci_addr) {
+	struct ixy_device* shared = (struct ixy_device*) memory_share_lookup(pci_addr);
+	if (!shared) {
+		error("device %s is not shared by a primary process", pci_addr);
+	}
+	if (is_virtio(pci_addr)) {
+		error("virtio devices can't be shared between processes");
+	}
+	return ixgbe_attach(pci_addr, shared);
+}
+
+// receive side scaling: distribute incoming packets over all rx queues based on a hash of their addresses and ports
+// key is the IXY_RSS_KEY_SIZE bytes long Toeplitz key (NULL for the default), fields a combination of IXY_RSS_* flags
+// drivers that support RSS enable it with the default key and all fields, the hash is in the metadata of each packet
+// returns false if the driver doesn't support this
+bool ixy_set_rss(struct ixy_device* dev, const uint8_t* key, uint32_t fields) {
+	if (!dev->set_rss) {
+		warn("RSS is not supported by %s", dev->driver_name);
+		return false;
+	}
+	dev->set_rss(dev, key, fields);
+	return true;
+}
+
+// flow filters (flow director on ixgbe): packets matching a filter go to its queue instead of the one chosen by RSS
+// filters are added and removed in batches, the return value is the number of filters that were added/removed
+// all filters on a device must use the same mode and fields, the first filter added determines them
+// hits and misses are counted in the device stats
+uint32_t ixy_add_filters(struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters) {
+	if (!dev->add_filters) {
+		warn("flow filters are not supported by %s", dev->driver_name);
+		return 0;
+	}
+	return dev->add_filters(dev, filters, num_filters);
+}
+
+uint32_t ixy_remove_filters(struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters) {
+	if (!dev->remove_filters) {
+		warn("flow filters are not supported by %s", dev->driver_name);
+		return 0;
+	}
+	return dev->remove_filters(dev, filters, num_filters);
+}
+
+// recycle mode for forwarding applications: bufs received on rx_queue and sent out via tx_queue are given back
+// directly to the rx queue once they are sent, skipping the round-trip through the mempool
+// each rx queue can be fed by a single tx queue (and vice versa), but both can be used from different threads
+// returns false if one of the drivers doesn't support this, bufs are then simply returned to the mempool
+bool ixy_enable_recycling(struct ixy_device* rx_dev, uint16_t rx_queue, struct ixy_device* tx_dev, uint16_t tx_queue) {
+	if (!rx_dev->get_rx_recycle_ring || !tx_dev->set_tx_recycle_ring) {
+		warn("recycle mode is not supported by %s -> %s", rx_dev->driver_name, tx_dev->driver_name);
+		return false;
 	}
+	struct recycle_ring* ring = rx_dev->get_rx_recycle_ring(rx_dev, rx_queue);
+	tx_dev->set_tx_recycle_ring(tx_dev, tx_queue, ring);
+	info("recycling bufs sent by %s queue %u to rx queue %u of %s", tx_dev->pci_addr, tx_queue, rx_queue, rx_dev->pci_addr);
+	return true;
 }
@@ -2,6 +2,7 @@
 #define IXY_DEVICE_H
 
 #include <stdint.h>
+#include <sys/io.h>
 #include <unistd.h>
 
 #include "log.h"
@@ -30,19 +31,69 @@ struct device_stats;
 	(type*)((char*)__mptr - offsetof(type, member));\
 })
 
+// packet types to calculate the RSS hash over (addresses and ports for TCP/UDP), see ixy_set_rss
+#define IXY_RSS_IPV4     0x01
+#define IXY_RSS_IPV4_TCP 0x02
+#define IXY_RSS_IPV4_UDP 0x04
+#define IXY_RSS_IPV6     0x08
+#define IXY_RSS_IPV6_TCP 0x10
+#define IXY_RSS_IPV6_UDP 0x20
+#define IXY_RSS_ALL      0x3F
+#define IXY_RSS_KEY_SIZE 40
+
+// flow filters steer matching packets to a specific rx queue, see ixy_add_filters
+// perfect filters compare the fields, signature filters only a hash of them (collisions can cause false positives)
+#define IXY_FILTER_PERFECT   0
+#define IXY_FILTER_SIGNATURE 1
+// fields compared by a flow filter, all other fields are wildcards
+#define IXY_FILTER_SRC_IP   0x01
+#define IXY_FILTER_DST_IP   0x02
+#define IXY_FILTER_SRC_PORT 0x04
+#define IXY_FILTER_DST_PORT 0x08
+#define IXY_FILTER_L4_PROTO 0x10
+
+// IPv4 flow filter, addresses and ports are in network byte order
+struct ixy_flow_filter {
+	uint8_t mode; // IXY_FILTER_PERFECT or IXY_FILTER_SIGNATURE
+	uint8_t fields; // combination of IXY_FILTER_* field flags
+	uint8_t l4_proto; // IPPROTO_TCP or IPPROTO_UDP, required for ports
+	uint16_t queue;
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint16_t src_port;
+	uint16_t dst_port;
+};
+
 struct ixy_device {
 	const char* pci_addr;
 	const char* driver_name;
 	uint16_t num_rx_queues;
 	uint16_t num_tx_queues;
+	// assigned in the order of ixy_init calls, stored in the metadata of received bufs
+	uint8_t port_id;
+	// DMA memory of the driver is allocated on this node, apps should place their mempools and threads here as well
+	int numa_node;
 	uint32_t (*rx_batch) (struct ixy_device* dev, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs);
 	uint32_t (*tx_batch) (struct ixy_device* dev, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs);
 	void (*read_stats) (struct ixy_device* dev, struct device_stats* stats);
 	void (*set_promisc) (struct ixy_device* dev, bool enabled);
 	uint32_t (*get_link_speed) (const struct ixy_device* dev);
+	// optional, NULL if the driver doesn't support recycle mode (see ixy_enable_recycling)
+	struct recycle_ring* (*get_rx_recycle_ring) (struct ixy_device* dev, uint16_t queue_id);
+	void (*set_tx_recycle_ring) (struct ixy_device* dev, uint16_t queue_id, struct recycle_ring* ring);
+	// optional, NULL if the driver doesn't support RSS (see ixy_set_rss)
+	void (*set_rss) (struct ixy_device* dev, const uint8_t* key, uint32_t fields);
+	// optional, NULL if the driver doesn't support flow filters (see ixy_add_filters)
+	uint32_t (*add_filters) (struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters);
+	uint32_t (*remove_filters) (struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters);
 };
 
 struct ixy_device* ixy_init(const char* pci_addr, uint16_t rx_queues, uint16_t tx_queues);
+struct ixy_device* ixy_attach(const char* pci_addr);
+bool ixy_set_rss(struct ixy_device* dev, const uint8_t* key, uint32_t fields);
+uint32_t ixy_add_filters(struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters);
+uint32_t ixy_remove_filters(struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters);
+bool ixy_enable_recycling(struct ixy_device* rx_dev, uint16_t rx_queue, struct ixy_device* tx_dev, uint16_t tx_queue);
 
 // Public stubs that forward the calls to the driver-specific implementations
 static inline uint32_t ixy_rx_batch(struct ixy_device* dev, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
@@ -89,6 +140,27 @@ static inline uint32_t get_reg32(const uint8_t* addr, int reg) {
 	return *((volatile uint32_t*) (addr + reg));
 }
 
+// narrower registers, e.g., the virtio 1.0 common configuration structure
+static inline void set_reg16(uint8_t* addr, int reg, uint16_t value) {
+	__asm__ volatile ("" : : : "memory");
+	*((volatile uint16_t*) (addr + reg)) = value;
+}
+
+static inline uint16_t get_reg16(const uint8_t* addr, int reg) {
+	__asm__ volatile ("" : : : "memory");
+	return *((volatile uint16_t*) (addr + reg));
+}
+
+static inline void set_reg8(uint8_t* addr, int reg, uint8_t value) {
+	__asm__ volatile ("" : : : "memory");
+	*((volatile uint8_t*) (addr + reg)) = value;
+}
+
+static inline uint8_t get_reg8(const uint8_t* addr, int reg) {
+	__asm__ volatile ("" : : : "memory");
+	return *((volatile uint8_t*) (addr + reg));
+}
+
 static inline void set_flags32(uint8_t* addr, int reg, uint32_t flags) {
 	set_reg32(addr, reg, get_reg32(addr, reg) | flags);
 }
@@ -161,4 +233,36 @@ static inline uint8_t read_io8(int fd, size_t offset) {
 	return temp;
 }
 
+// getters/setters for io ports with direct port i/o (see pci_enable_ioports), no syscall involved
+
+static inline void write_port32(uint16_t port, uint32_t value, size_t offset) {
+	outl(value, port + offset);
+	__asm__ volatile("" : : : "memory");
+}
+
+static inline void write_port16(uint16_t port, uint16_t value, size_t offset) {
+	outw(value, port + offset);
+	__asm__ volatile("" : : : "memory");
+}
+
+static inline void write_port8(uint16_t port, uint8_t value, size_t offset) {
+	outb(value, port + offset);
+	__asm__ volatile("" : : : "memory");
+}
+
+static inline uint32_t read_port32(uint16_t port, size_t offset) {
+	__asm__ volatile("" : : : "memory");
+	return inl(port + offset);
+}
+
+static inline uint16_t read_port16(uint16_t port, size_t offset) {
+	__asm__ volatile("" : : : "memory");
+	return inw(port + offset);
+}
+
+static inline uint8_t read_port8(uint16_t port, size_t offset) {
+	__asm__ volatile("" : : : "memory");
+	return inb(port + offset);
+}
+
 #endif // IXY_DEVICE_H
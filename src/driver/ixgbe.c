@@ -1,6 +1,9 @@
+#include <smmintrin.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 #include "log.h"
 #include "ixgbe.h"
@@ -20,6 +23,37 @@ const int NUM_TX_QUEUE_ENTRIES = 512;
 
 const int TX_CLEAN_BATCH = 32;
 
+// number of bufs an rx queue in recycle mode takes out of its recycle ring at once
+#define RX_RECYCLE_BATCH 32
+
+// the vector rx path refills descriptors in batches of this size and only updates RDT once per batch
+#define RX_REFILL_BATCH 32
+
+// the 82599 can only handle rx buffer sizes in increments of 1 kb, we need a few headers (1 cacheline) in front of the data
+// without jumbo frames the device could write 2 kb into a 2 kb mempool entry, but it never receives more than 1522 bytes
+const int RX_BUF_ENTRY_SIZE = 2048;
+const int RX_BUF_SIZE = 2048;
+// with jumbo frames (IXY_JUMBO_FRAMES=1) 4 kb mempool entries leave 4032 bytes for the device, so we use 3 kb per descriptor
+// larger frames are split over multiple descriptors and end up in a chain of bufs
+const int RX_BUF_ENTRY_SIZE_JUMBO = 4096;
+const int RX_BUF_SIZE_JUMBO = 3072;
+
+// 9000 byte MTU + ethernet header, a VLAN tag and the CRC
+const int MAX_FRAME_SIZE = 9022;
+
+// the redirection table (RETA) has 128 entries with 4 bit queue indices, so RSS is limited to 16 queues
+const int RSS_RETA_SIZE = 128;
+const int RSS_MAX_QUEUES = 16;
+
+// the widely used default key from Microsoft's RSS specification
+static const uint8_t default_rss_key[IXY_RSS_KEY_SIZE] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
 // allocated for each rx queue, keeps state for the receive function
 struct ixgbe_rx_queue {
 	volatile union ixgbe_adv_rx_desc* descriptors;
@@ -27,6 +61,17 @@ struct ixgbe_rx_queue {
 	uint16_t num_entries;
 	// position we are reading from
 	uint16_t rx_index;
+	// first descriptor that was received but didn't get a new buf yet, equal to rx_index if the ring is full
+	uint16_t refill_index;
+	// number of times the mempool was empty on refill, read and reset by ixgbe_read_stats
+	uint32_t refill_deferred;
+	// first and last segment of a multi-segment packet that is not yet complete
+	struct pkt_buf* pkt_head;
+	struct pkt_buf* pkt_tail;
+	// recycle mode: sent bufs from a tx queue arrive here, refill takes them before going to the mempool
+	struct recycle_ring* recycle_ring;
+	struct pkt_buf* recycled[RX_RECYCLE_BATCH];
+	uint32_t num_recycled;
 	// virtual addresses to map descriptors back to their mbuf for freeing
 	void* virtual_addresses[];
 };
@@ -39,10 +84,27 @@ struct ixgbe_tx_queue {
 	uint16_t clean_index;
 	// position to insert packets for transmission
 	uint16_t tx_index;
+	// first descriptor of the current clean batch, RS is set on the first packet end at least TX_CLEAN_BATCH - 1 after it
+	uint16_t rs_index;
+	// recycle mode: sent bufs go here instead of the mempool, NULL if disabled
+	struct recycle_ring* recycle_ring;
+	// the nic writes its head index here instead of setting DD in the descriptors, NULL if disabled
+	volatile uint32_t* head_wb;
 	// virtual addresses to map descriptors back to their mbuf for freeing
 	void* virtual_addresses[];
 };
 
+// the queues are allocated back to back, each one followed by the space for its virtual_addresses array
+static inline struct ixgbe_rx_queue* get_rx_queue(struct ixgbe_device* dev, uint16_t queue_id) {
+	size_t queue_size = sizeof(struct ixgbe_rx_queue) + sizeof(void*) * MAX_RX_QUEUE_ENTRIES;
+	return (struct ixgbe_rx_queue*) ((uint8_t*) dev->rx_queues + queue_id * queue_size);
+}
+
+static inline struct ixgbe_tx_queue* get_tx_queue(struct ixgbe_device* dev, uint16_t queue_id) {
+	size_t queue_size = sizeof(struct ixgbe_tx_queue) + sizeof(void*) * MAX_TX_QUEUE_ENTRIES;
+	return (struct ixgbe_tx_queue*) ((uint8_t*) dev->tx_queues + queue_id * queue_size);
+}
+
 // see section 4.6.4
 static void init_link(struct ixgbe_device* dev) {
 	// should already be set by the eeprom config, maybe we shouldn't override it here to support weirdo nics?
@@ -55,15 +117,11 @@ static void init_link(struct ixgbe_device* dev) {
 
 static void start_rx_queue(struct ixgbe_device* dev, int queue_id) {
 	debug("starting rx queue %d", queue_id);
-	struct ixgbe_rx_queue* queue = ((struct ixgbe_rx_queue*)(dev->rx_queues)) + queue_id;
-	// 2048 as pktbuf size is strictly speaking incorrect:
-	// we need a few headers (1 cacheline), so there's only 1984 bytes left for the device
-	// but the 82599 can only handle sizes in increments of 1 kb; but this is fine since our max packet size
-	// is the default MTU of 1518
-	// this has to be fixed if jumbo frames are to be supported
+	struct ixgbe_rx_queue* queue = get_rx_queue(dev, queue_id);
 	// mempool should be >= the number of rx and tx descriptors for a forwarding application
 	uint32_t mempool_size = NUM_RX_QUEUE_ENTRIES + NUM_TX_QUEUE_ENTRIES;
-	queue->mempool = memory_allocate_mempool(mempool_size < 4096 ? 4096 : mempool_size, 2048);
+	uint32_t entry_size = dev->jumbo_frames ? RX_BUF_ENTRY_SIZE_JUMBO : RX_BUF_ENTRY_SIZE;
+	queue->mempool = memory_allocate_mempool_node(mempool_size < 4096 ? 4096 : mempool_size, entry_size, dev->ixy.numa_node);
 	if (queue->num_entries & (queue->num_entries - 1)) {
 		error("number of queue entries must be a power of 2");
 	}
@@ -89,7 +147,7 @@ static void start_rx_queue(struct ixgbe_device* dev, int queue_id) {
 
 static void start_tx_queue(struct ixgbe_device* dev, int queue_id) {
 	debug("starting tx queue %d", queue_id);
-	struct ixgbe_tx_queue* queue = ((struct ixgbe_tx_queue*)(dev->tx_queues)) + queue_id;
+	struct ixgbe_tx_queue* queue = get_tx_queue(dev, queue_id);
 	if (queue->num_entries & (queue->num_entries - 1)) {
 		error("number of queue entries must be a power of 2");
 	}
@@ -101,6 +159,230 @@ static void start_tx_queue(struct ixgbe_device* dev, int queue_id) {
 	wait_set_reg32(dev->addr, IXGBE_TXDCTL(queue_id), IXGBE_TXDCTL_ENABLE);
 }
 
+// see section 7.1.2.8
+// the hash is calculated for all packets, even with a single queue, and ends up in the rx descriptor
+void ixgbe_set_rss(struct ixy_device* ixy, const uint8_t* key, uint32_t fields) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	// tx-only devices: nothing to distribute to, leave everything at the reset defaults
+	if (ixy->num_rx_queues == 0) {
+		debug("no rx queues, skipping RSS setup");
+		return;
+	}
+	key = key ? key : default_rss_key;
+	// the key is stored little endian, i.e., the first byte of the key is the lowest byte of RSSRK(0)
+	for (int i = 0; i < IXY_RSS_KEY_SIZE / 4; i++) {
+		uint32_t rssrk = key[i * 4] | key[i * 4 + 1] << 8 | key[i * 4 + 2] << 16 | (uint32_t) key[i * 4 + 3] << 24;
+		set_reg32(dev->addr, IXGBE_RSSRK(i), rssrk);
+	}
+	// spread the queues evenly over the redirection table, 4 entries per register
+	uint16_t num_queues = ixy->num_rx_queues;
+	if (num_queues > RSS_MAX_QUEUES) {
+		warn("RSS can only distribute packets to %d queues, the other queues won't receive anything", RSS_MAX_QUEUES);
+		num_queues = RSS_MAX_QUEUES;
+	}
+	uint32_t reta = 0;
+	for (int i = 0; i < RSS_RETA_SIZE; i++) {
+		reta |= (uint32_t) (i % num_queues) << ((i & 3) * 8);
+		if ((i & 3) == 3) {
+			set_reg32(dev->addr, IXGBE_RETA(i >> 2), reta);
+			reta = 0;
+		}
+	}
+	uint32_t mrqc = IXGBE_MRQC_RSSEN;
+	mrqc |= fields & IXY_RSS_IPV4 ? IXGBE_MRQC_RSS_FIELD_IPV4 : 0;
+	mrqc |= fields & IXY_RSS_IPV4_TCP ? IXGBE_MRQC_RSS_FIELD_IPV4_TCP : 0;
+	mrqc |= fields & IXY_RSS_IPV4_UDP ? IXGBE_MRQC_RSS_FIELD_IPV4_UDP : 0;
+	mrqc |= fields & IXY_RSS_IPV6 ? IXGBE_MRQC_RSS_FIELD_IPV6 | IXGBE_MRQC_RSS_FIELD_IPV6_EX : 0;
+	mrqc |= fields & IXY_RSS_IPV6_TCP ? IXGBE_MRQC_RSS_FIELD_IPV6_TCP | IXGBE_MRQC_RSS_FIELD_IPV6_EX_TCP : 0;
+	mrqc |= fields & IXY_RSS_IPV6_UDP ? IXGBE_MRQC_RSS_FIELD_IPV6_UDP | IXGBE_MRQC_RSS_FIELD_IPV6_EX_UDP : 0;
+	// everything else (non-IP packets and packets with disabled fields) goes to queue 0
+	set_reg32(dev->addr, IXGBE_MRQC, fields ? mrqc : 0);
+	debug("RSS configured for %d queues, fields 0x%02X", num_queues, fields);
+}
+
+// flow director hash, see section 7.1.2.7.15
+// the 32 bit key is applied to the flow type/vlan dword and the xor of all other dwords of the (masked) flow fields
+// this is the same shortcut as used by the Linux driver, the result has to be cut down to the hash size by the caller
+static uint32_t fdir_hash(uint32_t key, uint32_t flow_vm_vlan, uint32_t common) {
+	uint32_t hi = common ^ flow_vm_vlan ^ (flow_vm_vlan >> 16);
+	uint32_t lo = (common >> 16) | (common << 16);
+	uint32_t hash = 0;
+	for (int i = 0; i < 16; i++) {
+		// the flow type/vlan bits are only applied to the low word after bit 0 was processed
+		if (i == 1) {
+			lo ^= flow_vm_vlan ^ (flow_vm_vlan << 16);
+		}
+		if (key & (1u << i)) {
+			hash ^= lo >> i;
+		}
+		if (key & (1u << (i + 16))) {
+			hash ^= hi >> i;
+		}
+	}
+	return hash;
+}
+
+// the l4 type is part of the flow type, it's masked out like the other fields if it isn't compared
+static uint32_t fdir_flow_type(const struct ixy_flow_filter* filter, uint8_t fields) {
+	if (!(fields & IXY_FILTER_L4_PROTO)) {
+		return IXGBE_ATR_FLOW_TYPE_IPV4;
+	}
+	switch (filter->l4_proto) {
+		case IPPROTO_TCP:
+			return IXGBE_ATR_FLOW_TYPE_TCPV4;
+		case IPPROTO_UDP:
+			return IXGBE_ATR_FLOW_TYPE_UDPV4;
+		default:
+			return IXGBE_ATR_FLOW_TYPE_IPV4;
+	}
+}
+
+// bucket hash in the lower 16 bits, signature in the upper 16 bits
+// perfect filters use the signature as software index to identify the filter on removal
+static uint32_t fdir_filter_hash(const struct ixy_flow_filter* filter, uint8_t mode, uint8_t fields) {
+	uint32_t flow_type = fdir_flow_type(filter, fields);
+	uint32_t src_ip = fields & IXY_FILTER_SRC_IP ? ntohl(filter->src_ip) : 0;
+	uint32_t dst_ip = fields & IXY_FILTER_DST_IP ? ntohl(filter->dst_ip) : 0;
+	uint32_t src_port = fields & IXY_FILTER_SRC_PORT ? ntohs(filter->src_port) : 0;
+	uint32_t dst_port = fields & IXY_FILTER_DST_PORT ? ntohs(filter->dst_port) : 0;
+	uint32_t flow_vm_vlan = flow_type << 16;
+	uint32_t common = src_ip ^ dst_ip ^ (src_port << 16 | dst_port);
+	// perfect filters only have 8k buckets
+	uint32_t bucket = fdir_hash(IXGBE_ATR_BUCKET_HASH_KEY, flow_vm_vlan, common) & (mode == IXY_FILTER_PERFECT ? 0x1FFF : IXGBE_ATR_HASH_MASK);
+	uint32_t sig = fdir_hash(IXGBE_ATR_SIGNATURE_HASH_KEY, flow_vm_vlan, common) & IXGBE_ATR_HASH_MASK;
+	return bucket | sig << IXGBE_FDIRHASH_SIG_SW_INDEX_SHIFT;
+}
+
+// see section 7.1.2.7.10, all filters use the same masks and mode, so the first filter configures flow director
+// the filter tables take 256 kb from the rx packet buffer, that's fine since we only use 128 kb for packets (init_rx)
+static void fdir_enable(struct ixgbe_device* dev, uint8_t mode, uint8_t fields) {
+	// flow director can only be initialized while rx is disabled, this drops packets for a short time
+	clear_flags32(dev->addr, IXGBE_RXCTRL, IXGBE_RXCTRL_RXEN);
+	uint32_t fdirm = IXGBE_FDIRM_VLANID | IXGBE_FDIRM_VLANP | IXGBE_FDIRM_POOL | IXGBE_FDIRM_FLEX;
+	fdirm |= fields & IXY_FILTER_L4_PROTO ? 0 : IXGBE_FDIRM_L4P;
+	set_reg32(dev->addr, IXGBE_FDIRM, fdirm);
+	// the other mask registers are inverted: set bits are ignored
+	set_reg32(dev->addr, IXGBE_FDIRSIP4M, fields & IXY_FILTER_SRC_IP ? 0 : 0xFFFFFFFF);
+	set_reg32(dev->addr, IXGBE_FDIRDIP4M, fields & IXY_FILTER_DST_IP ? 0 : 0xFFFFFFFF);
+	uint32_t portm = (fields & IXY_FILTER_SRC_PORT ? 0 : 0xFFFF) | (fields & IXY_FILTER_DST_PORT ? 0 : 0xFFFF) << IXGBE_FDIRTCPM_DPORTM_SHIFT;
+	set_reg32(dev->addr, IXGBE_FDIRTCPM, portm);
+	set_reg32(dev->addr, IXGBE_FDIRUDPM, portm);
+	set_reg32(dev->addr, IXGBE_FDIRHKEY, IXGBE_ATR_BUCKET_HASH_KEY);
+	set_reg32(dev->addr, IXGBE_FDIRSKEY, IXGBE_ATR_SIGNATURE_HASH_KEY);
+	// max length and full threshold are the defaults from the Linux driver
+	// we don't set the report status flag as it replaces the rss hash in the rx descriptor with the filter id
+	uint32_t fdirctrl = IXGBE_FDIRCTRL_PBALLOC_256K | (0xA << IXGBE_FDIRCTRL_MAX_LENGTH_SHIFT) | (4 << IXGBE_FDIRCTRL_FULL_THRESH_SHIFT);
+	fdirctrl |= mode == IXY_FILTER_PERFECT ? IXGBE_FDIRCTRL_PERFECT_MATCH : 0;
+	set_reg32(dev->addr, IXGBE_FDIRCTRL, fdirctrl);
+	wait_set_reg32(dev->addr, IXGBE_FDIRCTRL, IXGBE_FDIRCTRL_INIT_DONE);
+	set_flags32(dev->addr, IXGBE_RXCTRL, IXGBE_RXCTRL_RXEN);
+	dev->fdir_enabled = true;
+	dev->fdir_mode = mode;
+	dev->fdir_fields = fields;
+	info("flow director enabled in %s mode, fields 0x%02X", mode == IXY_FILTER_PERFECT ? "perfect" : "signature", fields);
+}
+
+// filter commands are executed one after another, returns the final FDIRCMD value
+static uint32_t fdir_wait_cmd(struct ixgbe_device* dev) {
+	uint32_t fdircmd = 0;
+	for (int i = 0; i < IXGBE_FDIRCMD_CMD_POLL; i++) {
+		fdircmd = get_reg32(dev->addr, IXGBE_FDIRCMD);
+		if (!(fdircmd & IXGBE_FDIRCMD_CMD_MASK)) {
+			return fdircmd;
+		}
+		usleep(10);
+	}
+	warn("flow director command timed out, FDIRCMD 0x%08X", fdircmd);
+	return fdircmd;
+}
+
+static bool fdir_check_filter(struct ixgbe_device* dev, const struct ixy_flow_filter* filter) {
+	if (filter->mode != dev->fdir_mode || filter->fields != dev->fdir_fields) {
+		warn("flow filter mode %u fields 0x%02X doesn't match the configured mode %u fields 0x%02X, skipping it",
+			filter->mode, filter->fields, dev->fdir_mode, dev->fdir_fields);
+		return false;
+	}
+	if (filter->queue >= dev->ixy.num_rx_queues) {
+		warn("flow filter for non-existing rx queue %u, skipping it", filter->queue);
+		return false;
+	}
+	if (filter->fields & (IXY_FILTER_SRC_PORT | IXY_FILTER_DST_PORT | IXY_FILTER_L4_PROTO)
+			&& filter->l4_proto != IPPROTO_TCP && filter->l4_proto != IPPROTO_UDP) {
+		warn("flow filters for ports and protocols only support TCP and UDP, skipping filter with protocol %u", filter->l4_proto);
+		return false;
+	}
+	return true;
+}
+
+// see section 7.1.2.7.11
+// each command is checked against the hardware's failed-add counter, adding fails if a bucket overflows
+uint32_t ixgbe_add_filters(struct ixy_device* ixy, const struct ixy_flow_filter filters[], uint32_t num_filters) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	if (!num_filters) {
+		return 0;
+	}
+	if (!dev->fdir_enabled) {
+		fdir_enable(dev, filters[0].mode, filters[0].fields);
+	}
+	uint32_t num_added = 0;
+	uint32_t failed = get_reg32(dev->addr, IXGBE_FDIRFSTAT) & IXGBE_FDIRFSTAT_FADD_MASK;
+	for (uint32_t i = 0; i < num_filters; i++) {
+		const struct ixy_flow_filter* filter = &filters[i];
+		if (!fdir_check_filter(dev, filter)) {
+			continue;
+		}
+		// the flow fields are only needed for perfect filters, signature filters just use the hash
+		if (dev->fdir_mode == IXY_FILTER_PERFECT) {
+			set_reg32(dev->addr, IXGBE_FDIRIPSA, ntohl(filter->src_ip));
+			set_reg32(dev->addr, IXGBE_FDIRIPDA, ntohl(filter->dst_ip));
+			set_reg32(dev->addr, IXGBE_FDIRPORT, ntohs(filter->src_port) | (uint32_t) ntohs(filter->dst_port) << IXGBE_FDIRPORT_DESTINATION_SHIFT);
+			set_reg32(dev->addr, IXGBE_FDIRVLAN, 0);
+		}
+		set_reg32(dev->addr, IXGBE_FDIRHASH, fdir_filter_hash(filter, dev->fdir_mode, dev->fdir_fields));
+		uint32_t fdircmd = IXGBE_FDIRCMD_CMD_ADD_FLOW | IXGBE_FDIRCMD_FILTER_UPDATE | IXGBE_FDIRCMD_LAST | IXGBE_FDIRCMD_QUEUE_EN;
+		fdircmd |= fdir_flow_type(filter, dev->fdir_fields) << IXGBE_FDIRCMD_FLOW_TYPE_SHIFT;
+		fdircmd |= (uint32_t) filter->queue << IXGBE_FDIRCMD_RX_QUEUE_SHIFT;
+		set_reg32(dev->addr, IXGBE_FDIRCMD, fdircmd);
+		fdir_wait_cmd(dev);
+		uint32_t now_failed = get_reg32(dev->addr, IXGBE_FDIRFSTAT) & IXGBE_FDIRFSTAT_FADD_MASK;
+		if (now_failed != failed) {
+			warn("failed to add flow filter %u to queue %u, the bucket is probably full", i, filter->queue);
+			failed = now_failed;
+			continue;
+		}
+		num_added++;
+	}
+	debug("added %u of %u flow filters", num_added, num_filters);
+	return num_added;
+}
+
+// filters are identified by their hash, so removing a filter requires the same fields as adding it
+uint32_t ixgbe_remove_filters(struct ixy_device* ixy, const struct ixy_flow_filter filters[], uint32_t num_filters) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	if (!dev->fdir_enabled) {
+		return 0;
+	}
+	uint32_t num_removed = 0;
+	for (uint32_t i = 0; i < num_filters; i++) {
+		const struct ixy_flow_filter* filter = &filters[i];
+		if (!fdir_check_filter(dev, filter)) {
+			continue;
+		}
+		uint32_t fdirhash = fdir_filter_hash(filter, dev->fdir_mode, dev->fdir_fields);
+		set_reg32(dev->addr, IXGBE_FDIRHASH, fdirhash);
+		set_reg32(dev->addr, IXGBE_FDIRCMD, IXGBE_FDIRCMD_CMD_QUERY_REM_FILT);
+		if (!(fdir_wait_cmd(dev) & IXGBE_FDIRCMD_FILTER_VALID)) {
+			continue;
+		}
+		set_reg32(dev->addr, IXGBE_FDIRHASH, fdirhash);
+		set_reg32(dev->addr, IXGBE_FDIRCMD, IXGBE_FDIRCMD_CMD_REMOVE_FLOW);
+		fdir_wait_cmd(dev);
+		num_removed++;
+	}
+	debug("removed %u of %u flow filters", num_removed, num_filters);
+	return num_removed;
+}
+
 // see section 4.6.7
 // it looks quite complicated in the data sheet, but it's actually really easy because we don't need fancy features
 static void init_rx(struct ixgbe_device* dev) {
@@ -120,6 +402,17 @@ static void init_rx(struct ixgbe_device* dev) {
 	// accept broadcast packets
 	set_flags32(dev->addr, IXGBE_FCTRL, IXGBE_FCTRL_BAM);
 
+	// optional jumbo frames, enabled by setting IXY_JUMBO_FRAMES=1, they are received into multiple descriptors
+	// the rx mempools use larger entries then, so this is off by default
+	const char* jumbo_env = getenv("IXY_JUMBO_FRAMES");
+	dev->jumbo_frames = jumbo_env && !strcmp(jumbo_env, "1");
+	if (dev->jumbo_frames) {
+		info("accepting jumbo frames up to %d bytes", MAX_FRAME_SIZE);
+		set_flags32(dev->addr, IXGBE_HLREG0, IXGBE_HLREG0_JUMBOEN);
+		set_reg32(dev->addr, IXGBE_MAXFRS, (get_reg32(dev->addr, IXGBE_MAXFRS) & ~IXGBE_MHADD_MFS_MASK) | (MAX_FRAME_SIZE << IXGBE_MHADD_MFS_SHIFT));
+	}
+	uint32_t buf_size = dev->jumbo_frames ? RX_BUF_SIZE_JUMBO : RX_BUF_SIZE;
+
 	// per-queue config, same for all queues
 	for (uint16_t i = 0; i < dev->ixy.num_rx_queues; i++) {
 		debug("initializing rx queue %d", i);
@@ -128,9 +421,11 @@ static void init_rx(struct ixgbe_device* dev) {
 		// drop_en causes the nic to drop packets if no rx descriptors are available instead of buffering them
 		// a single overflowing queue can fill up the whole buffer and impact operations if not setting this flag
 		set_flags32(dev->addr, IXGBE_SRRCTL(i), IXGBE_SRRCTL_DROP_EN);
+		// buffer size is in units of 1 kb
+		set_reg32(dev->addr, IXGBE_SRRCTL(i), (get_reg32(dev->addr, IXGBE_SRRCTL(i)) & ~IXGBE_SRRCTL_BSIZEPKT_MASK) | (buf_size >> IXGBE_SRRCTL_BSIZEPKT_SHIFT));
 		// setup descriptor ring, see section 7.1.9
 		uint32_t ring_size_bytes = NUM_RX_QUEUE_ENTRIES * sizeof(union ixgbe_adv_rx_desc);
-		struct dma_memory mem = memory_allocate_dma(ring_size_bytes, true);
+		struct dma_memory mem = memory_allocate_dma_node(ring_size_bytes, true, dev->ixy.numa_node);
 		// neat trick from Snabb: initialize to 0xFF to prevent rogue memory accesses on premature DMA activation
 		memset(mem.virt, -1, ring_size_bytes);
 		set_reg32(dev->addr, IXGBE_RDBAL(i), (uint32_t) (mem.phy & 0xFFFFFFFFull));
@@ -142,12 +437,17 @@ static void init_rx(struct ixgbe_device* dev) {
 		set_reg32(dev->addr, IXGBE_RDH(i), 0);
 		set_reg32(dev->addr, IXGBE_RDT(i), 0);
 		// private data for the driver, 0-initialized
-		struct ixgbe_rx_queue* queue = ((struct ixgbe_rx_queue*)(dev->rx_queues)) + i;
+		struct ixgbe_rx_queue* queue = get_rx_queue(dev, i);
 		queue->num_entries = NUM_RX_QUEUE_ENTRIES;
 		queue->rx_index = 0;
+		queue->refill_index = 0;
 		queue->descriptors = (union ixgbe_adv_rx_desc*) mem.virt;
 	}
 
+	// the rss hash and the ip fragment checksum share a field in the descriptor, we want the hash
+	set_flags32(dev->addr, IXGBE_RXCSUM, IXGBE_RXCSUM_PCSD);
+	ixgbe_set_rss(&dev->ixy, NULL, IXY_RSS_ALL);
+
 	// last step is to set some magic bits mentioned in the last sentence in 4.6.7
 	set_flags32(dev->addr, IXGBE_CTRL_EXT, IXGBE_CTRL_EXT_NS_DIS);
 	// this flag probably refers to a broken feature: it's reserved and initialized as '1' but it must be set to '0'
@@ -175,13 +475,21 @@ static void init_tx(struct ixgbe_device* dev) {
 	set_reg32(dev->addr, IXGBE_DTXMXSZRQ, 0xFFFF);
 	clear_flags32(dev->addr, IXGBE_RTTDCS, IXGBE_RTTDCS_ARBDIS);
 
+	// optional tx head write-back instead of polling DD flags, enabled by setting IXY_TX_HEAD_WB=1
+	const char* head_wb_env = getenv("IXY_TX_HEAD_WB");
+	bool head_wb = head_wb_env && !strcmp(head_wb_env, "1");
+	if (head_wb) {
+		info("using tx head write-back");
+	}
+
 	// per-queue config for all queues
 	for (uint16_t i = 0; i < dev->ixy.num_tx_queues; i++) {
 		debug("initializing tx queue %d", i);
 
 		// setup descriptor ring, see section 7.1.9
+		// the head write-back target lives in the same allocation, right behind the ring
 		uint32_t ring_size_bytes = NUM_TX_QUEUE_ENTRIES * sizeof(union ixgbe_adv_tx_desc);
-		struct dma_memory mem = memory_allocate_dma(ring_size_bytes, true);
+		struct dma_memory mem = memory_allocate_dma_node(ring_size_bytes + sizeof(uint32_t), true, dev->ixy.numa_node);
 		memset(mem.virt, -1, ring_size_bytes);
 		set_reg32(dev->addr, IXGBE_TDBAL(i), (uint32_t) (mem.phy & 0xFFFFFFFFull));
 		set_reg32(dev->addr, IXGBE_TDBAH(i), (uint32_t) (mem.phy >> 32));
@@ -196,13 +504,21 @@ static void init_tx(struct ixgbe_device* dev) {
 		// there are no defines for this in ixgbe_type.h for some reason
 		// pthresh: 6:0, hthresh: 14:8, wthresh: 22:16
 		txdctl &= ~(0x3F | (0x3F << 8) | (0x3F << 16)); // clear bits
-		txdctl |= (36 | (8 << 8) | (4 << 16)); // from DPDK
+		// wthresh must be 0 as we only set RS on the last packet of each clean batch (like DPDK's tx_rs_thresh)
+		txdctl |= (36 | (8 << 8) | (0 << 16)); // from DPDK
 		set_reg32(dev->addr, IXGBE_TXDCTL(i), txdctl);
 
 		// private data for the driver, 0-initialized
-		struct ixgbe_tx_queue* queue = ((struct ixgbe_tx_queue*)(dev->tx_queues)) + i;
+		struct ixgbe_tx_queue* queue = get_tx_queue(dev, i);
 		queue->num_entries = NUM_TX_QUEUE_ENTRIES;
 		queue->descriptors = (union ixgbe_adv_tx_desc*) mem.virt;
+		// see section 7.2.3.5.2, the nic writes the head back whenever it would write back a descriptor with RS
+		if (head_wb) {
+			queue->head_wb = (volatile uint32_t*) ((uint8_t*) mem.virt + ring_size_bytes);
+			*queue->head_wb = 0;
+			set_reg32(dev->addr, IXGBE_TDWBAL(i), (uint32_t) ((mem.phy + ring_size_bytes) & 0xFFFFFFFFull) | IXGBE_TDWBAL_HEAD_WB_ENABLE);
+			set_reg32(dev->addr, IXGBE_TDWBAH(i), (uint32_t) ((mem.phy + ring_size_bytes) >> 32));
+		}
 	}
 	// final step: enable DMA
 	set_reg32(dev->addr, IXGBE_DMATXCTL, IXGBE_DMATXCTL_TE);
@@ -223,7 +539,7 @@ static void wait_for_link(const struct ixgbe_device* dev) {
 
 // see section 4.6.3
 static void reset_and_init(struct ixgbe_device* dev) {
-	info("Resetting device %s", dev->ixy.pci_addr);
+	info("Resetting device %s (NUMA node %d)", dev->ixy.pci_addr, dev->ixy.numa_node);
 	// section 4.6.3.1 - disable all interrupts
 	set_reg32(dev->addr, IXGBE_EIMC, 0x7FFFFFFF);
 
@@ -272,6 +588,24 @@ static void reset_and_init(struct ixgbe_device* dev) {
 	wait_for_link(dev);
 }
 
+// everything that is only valid in the current process: strings, function pointers, and the mapped BAR
+static void init_process_state(struct ixgbe_device* dev, const char* pci_addr) {
+	dev->ixy.pci_addr = strdup(pci_addr);
+	dev->ixy.driver_name = driver_name;
+	// the vector rx path needs SSE4.1, the scalar path is a fallback for old cpus
+	dev->ixy.rx_batch = __builtin_cpu_supports("sse4.1") ? ixgbe_rx_batch_vec : ixgbe_rx_batch;
+	dev->ixy.tx_batch = ixgbe_tx_batch;
+	dev->ixy.read_stats = ixgbe_read_stats;
+	dev->ixy.set_promisc = ixgbe_set_promisc;
+	dev->ixy.get_link_speed = ixgbe_get_link_speed;
+	dev->ixy.get_rx_recycle_ring = ixgbe_get_rx_recycle_ring;
+	dev->ixy.set_tx_recycle_ring = ixgbe_set_tx_recycle_ring;
+	dev->ixy.set_rss = ixgbe_set_rss;
+	dev->ixy.add_filters = ixgbe_add_filters;
+	dev->ixy.remove_filters = ixgbe_remove_filters;
+	dev->addr = pci_map_resource(pci_addr);
+}
+
 struct ixy_device* ixgbe_init(const char* pci_addr, uint16_t rx_queues, uint16_t tx_queues) {
 	if (getuid()) {
 		warn("Not running as root, this will probably fail");
@@ -282,23 +616,28 @@ struct ixy_device* ixgbe_init(const char* pci_addr, uint16_t rx_queues, uint16_t
 	if (tx_queues > MAX_QUEUES) {
 		error("cannot configure %d tx queues: limit is %d", tx_queues, MAX_QUEUES);
 	}
-	struct ixgbe_device* dev = (struct ixgbe_device*) malloc(sizeof(struct ixgbe_device));
-	dev->ixy.pci_addr = strdup(pci_addr);
-	dev->ixy.driver_name = driver_name;
+	// the device struct and the queues can be attached to by secondary processes in shared memory mode
+	struct ixgbe_device* dev = (struct ixgbe_device*) memory_allocate_metadata(sizeof(struct ixgbe_device));
 	dev->ixy.num_rx_queues = rx_queues;
 	dev->ixy.num_tx_queues = tx_queues;
-	dev->ixy.rx_batch = ixgbe_rx_batch;
-	dev->ixy.tx_batch = ixgbe_tx_batch;
-	dev->ixy.read_stats = ixgbe_read_stats;
-	dev->ixy.set_promisc = ixgbe_set_promisc;
-	dev->ixy.get_link_speed = ixgbe_get_link_speed;
-	dev->addr = pci_map_resource(pci_addr);
-	dev->rx_queues = calloc(rx_queues, sizeof(struct ixgbe_rx_queue) + sizeof(void*) * MAX_RX_QUEUE_ENTRIES);
-	dev->tx_queues = calloc(tx_queues, sizeof(struct ixgbe_tx_queue) + sizeof(void*) * MAX_TX_QUEUE_ENTRIES);
+	// rings and mempools are placed on the node the NIC is attached to
+	dev->ixy.numa_node = pci_get_numa_node(pci_addr);
+	init_process_state(dev, pci_addr);
+	dev->rx_queues = memory_allocate_metadata(rx_queues * (sizeof(struct ixgbe_rx_queue) + sizeof(void*) * MAX_RX_QUEUE_ENTRIES));
+	dev->tx_queues = memory_allocate_metadata(tx_queues * (sizeof(struct ixgbe_tx_queue) + sizeof(void*) * MAX_TX_QUEUE_ENTRIES));
 	reset_and_init(dev);
 	return &dev->ixy;
 }
 
+// secondary processes in shared memory mode get their own copy of the device initialized by the primary
+// the queues are shared, so each queue must only be used by one process
+struct ixy_device* ixgbe_attach(const char* pci_addr, struct ixy_device* shared) {
+	struct ixgbe_device* dev = (struct ixgbe_device*) malloc(sizeof(struct ixgbe_device));
+	*dev = *IXY_TO_IXGBE(shared);
+	init_process_state(dev, pci_addr);
+	return &dev->ixy;
+}
+
 uint32_t ixgbe_get_link_speed(const struct ixy_device* ixy) {
 	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
 	uint32_t links = get_reg32(dev->addr, IXGBE_LINKS);
@@ -336,11 +675,22 @@ void ixgbe_read_stats(struct ixy_device* ixy, struct device_stats* stats) {
 	uint32_t tx_pkts = get_reg32(dev->addr, IXGBE_GPTC);
 	uint64_t rx_bytes = get_reg32(dev->addr, IXGBE_GORCL) + (((uint64_t) get_reg32(dev->addr, IXGBE_GORCH)) << 32);
 	uint64_t tx_bytes = get_reg32(dev->addr, IXGBE_GOTCL) + (((uint64_t) get_reg32(dev->addr, IXGBE_GOTCH)) << 32);
+	// clear on read, these stay 0 while flow director is disabled
+	uint32_t filter_hits = get_reg32(dev->addr, IXGBE_FDIRMATCH);
+	uint32_t filter_misses = get_reg32(dev->addr, IXGBE_FDIRMISS);
+	uint64_t rx_refill_deferred = 0;
+	for (uint16_t i = 0; i < dev->ixy.num_rx_queues; i++) {
+		struct ixgbe_rx_queue* queue = get_rx_queue(dev, i);
+		rx_refill_deferred += __atomic_exchange_n(&queue->refill_deferred, 0, __ATOMIC_RELAXED);
+	}
 	if (stats) {
 		stats->rx_pkts += rx_pkts;
 		stats->tx_pkts += tx_pkts;
 		stats->rx_bytes += rx_bytes;
 		stats->tx_bytes += tx_bytes;
+		stats->rx_refill_deferred += rx_refill_deferred;
+		stats->filter_hits += filter_hits;
+		stats->filter_misses += filter_misses;
 	}
 }
 
@@ -352,53 +702,285 @@ void ixgbe_read_stats(struct ixy_device* ixy, struct device_stats* stats) {
 // try to receive a single packet if one is available, non-blocking
 // see datasheet section 7.1.9 for an explanation of the rx ring structure
 // tl;dr: we control the tail of the queue, the hardware the head
-uint32_t ixgbe_rx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
-	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
-	struct ixgbe_rx_queue* queue = ((struct ixgbe_rx_queue*)(dev->rx_queues)) + queue_id;
+// allocates a buf to refill an rx descriptor, bufs recycled from a tx queue are used first
+static inline struct pkt_buf* rx_alloc_buf(struct ixgbe_rx_queue* queue) {
+	if (queue->recycle_ring) {
+		if (!queue->num_recycled) {
+			queue->num_recycled = recycle_ring_get(queue->recycle_ring, queue->recycled, RX_RECYCLE_BATCH);
+		}
+		if (queue->num_recycled) {
+			return queue->recycled[--queue->num_recycled];
+		}
+	}
+	return pkt_buf_alloc(queue->mempool);
+}
+
+// translates the offload results from the last descriptor of a packet to the device-independent metadata
+static inline void rx_fill_meta(struct ixgbe_device* dev, uint16_t queue_id, struct pkt_buf* buf, const union ixgbe_adv_rx_desc* desc) {
+	uint32_t status = desc->wb.upper.status_error;
+	uint32_t pkt_info = desc->wb.lower.lo_dword.hs_rss.pkt_info;
+	struct pkt_buf_meta* meta = &buf->meta;
+	meta->port = dev->ixy.port_id;
+	meta->queue = queue_id;
+	meta->ol_flags = 0;
+	// rss type 0 means that no hash was calculated, e.g., because rss is disabled
+	if (pkt_info & IXGBE_RXDADV_RSSTYPE_MASK) {
+		meta->rss_hash = desc->wb.lower.hi_dword.rss;
+		meta->ol_flags |= PKT_RX_RSS_HASH;
+	}
+	// only valid if the nic identified the packet type, i.e., ETQF bit not set (see 7.1.6.2)
+	uint16_t packet_type = 0;
+	if (!(pkt_info & IXGBE_RXDADV_PKTTYPE_ETQF)) {
+		packet_type |= pkt_info & (IXGBE_RXDADV_PKTTYPE_IPV4 | IXGBE_RXDADV_PKTTYPE_IPV4_EX) ? PKT_TYPE_IPV4 : 0;
+		packet_type |= pkt_info & (IXGBE_RXDADV_PKTTYPE_IPV6 | IXGBE_RXDADV_PKTTYPE_IPV6_EX) ? PKT_TYPE_IPV6 : 0;
+		packet_type |= pkt_info & (IXGBE_RXDADV_PKTTYPE_IPV4_EX | IXGBE_RXDADV_PKTTYPE_IPV6_EX) ? PKT_TYPE_IP_EXT : 0;
+		packet_type |= pkt_info & IXGBE_RXDADV_PKTTYPE_TCP ? PKT_TYPE_TCP : 0;
+		packet_type |= pkt_info & IXGBE_RXDADV_PKTTYPE_UDP ? PKT_TYPE_UDP : 0;
+		packet_type |= pkt_info & IXGBE_RXDADV_PKTTYPE_SCTP ? PKT_TYPE_SCTP : 0;
+	}
+	meta->packet_type = packet_type;
+	// the tag is still in the packet, we don't enable vlan stripping
+	if (status & IXGBE_RXDADV_STAT_VP) {
+		meta->vlan_tci = desc->wb.upper.vlan;
+		meta->ol_flags |= PKT_RX_VLAN;
+	}
+	if (status & IXGBE_RXD_STAT_IPCS) {
+		meta->ol_flags |= status & IXGBE_RXDADV_ERR_IPE ? PKT_RX_IP_CKSUM_BAD : PKT_RX_IP_CKSUM_GOOD;
+	}
+	if (status & IXGBE_RXD_STAT_L4CS) {
+		meta->ol_flags |= status & IXGBE_RXDADV_ERR_TCPE ? PKT_RX_L4_CKSUM_BAD : PKT_RX_L4_CKSUM_GOOD;
+	}
+	// only set for ieee 1588 packets if timestamping is enabled in TSYNCRXCTL, the nic latches a single timestamp
+	// in registers, reading the high part unlocks them for the next packet (section 7.9.1)
+	if (status & IXGBE_RXDADV_STAT_TS) {
+		uint64_t low = get_reg32(dev->addr, IXGBE_RXSTMPL);
+		meta->timestamp = low | (uint64_t) get_reg32(dev->addr, IXGBE_RXSTMPH) << 32;
+		meta->ol_flags |= PKT_RX_TIMESTAMP;
+	}
+}
+
+// gives new bufs to the descriptors received since the last refill and passes them back to the nic
+// stops early if the mempool is empty, the remaining descriptors stay with us and are refilled in one of the next calls
+// the nic can't get to them in the meantime: it stops at RDT which always points to the last refilled descriptor
+static void rx_refill(struct ixgbe_device* dev, struct ixgbe_rx_queue* queue, uint16_t queue_id) {
+	uint16_t refill_index = queue->refill_index;
+	if (refill_index == queue->rx_index) {
+		return;
+	}
+	while (refill_index != queue->rx_index) {
+		struct pkt_buf* buf = rx_alloc_buf(queue);
+		if (!buf) {
+			__atomic_add_fetch(&queue->refill_deferred, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		volatile union ixgbe_adv_rx_desc* desc_ptr = queue->descriptors + refill_index;
+		desc_ptr->read.pkt_addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data);
+		desc_ptr->read.hdr_addr = 0; // this resets the flags
+		queue->virtual_addresses[refill_index] = buf;
+		refill_index = wrap_ring(refill_index, queue->num_entries);
+	}
+	if (refill_index != queue->refill_index) {
+		// tell hardware that we are done
+		// this is intentionally off by one, otherwise we'd set RDT=RDH if we are receiving faster than packets are coming in
+		// RDT=RDH means queue is full
+		set_reg32(dev->addr, IXGBE_RDT(queue_id), (refill_index - 1) & (queue->num_entries - 1));
+		queue->refill_index = refill_index;
+	}
+}
+
+// scalar rx path, checks and copies one descriptor at a time; also handles everything the vector path leaves over
+static inline uint32_t rx_process(struct ixgbe_device* dev, struct ixgbe_rx_queue* queue, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
 	uint16_t rx_index = queue->rx_index; // rx index we checked in the last run of this function
-	uint16_t last_rx_index = rx_index; // index of the descriptor we checked in the last iteration of the loop
-	uint32_t buf_index;
-	for (buf_index = 0; buf_index < num_bufs; buf_index++) {
+	uint32_t buf_index = 0;
+	while (buf_index < num_bufs) {
 		// rx descriptors are explained in 7.1.5
 		volatile union ixgbe_adv_rx_desc* desc_ptr = queue->descriptors + rx_index;
 		uint32_t status = desc_ptr->wb.upper.status_error;
-		if (status & IXGBE_RXDADV_STAT_DD) {
-			if (!(status & IXGBE_RXDADV_STAT_EOP)) {
-				error("multi-segment packets are not supported - increase buffer size or decrease MTU");
-			}
-			// got a packet, read and copy the whole descriptor
-			union ixgbe_adv_rx_desc desc = *desc_ptr;
-			struct pkt_buf* buf = (struct pkt_buf*) queue->virtual_addresses[rx_index];
-			buf->size = desc.wb.upper.length;
-			// this would be the place to implement RX offloading by translating the device-specific flags
-			// to an independent representation in the buf (similiar to how DPDK works)
-			// need a new mbuf for the descriptor
-			struct pkt_buf* new_buf = pkt_buf_alloc(queue->mempool);
-			if (!new_buf) {
-				// we could handle empty mempools more gracefully here, but it would be quite messy...
-				// make your mempools large enough
-				error("failed to allocate new mbuf for rx, you are either leaking memory or your mempool is too small");
-			}
-			// reset the descriptor
-			desc_ptr->read.pkt_addr = new_buf->buf_addr_phy + offsetof(struct pkt_buf, data);
-			desc_ptr->read.hdr_addr = 0; // this resets the flags
-			queue->virtual_addresses[rx_index] = new_buf;
-			bufs[buf_index] = buf;
-			// want to read the next one in the next iteration, but we still need the last/current to update RDT later
-			last_rx_index = rx_index;
-			rx_index = wrap_ring(rx_index, queue->num_entries);
+		if (!(status & IXGBE_RXDADV_STAT_DD)) {
+			break;
+		}
+		// got a packet, read and copy the whole descriptor
+		union ixgbe_adv_rx_desc desc = *desc_ptr;
+		struct pkt_buf* buf = (struct pkt_buf*) queue->virtual_addresses[rx_index];
+		buf->size = desc.wb.upper.length;
+		buf->flags |= PKT_BUF_DIRTY;
+		// the descriptor needs a new mbuf, this is done for all received descriptors at once below
+		rx_index = wrap_ring(rx_index, queue->num_entries);
+		// packets larger than the rx buffer size are spread over multiple descriptors, only the last one has EOP set
+		// the chain can also be incomplete at the end of a batch, we keep it in the queue until the rest arrives
+		if (queue->pkt_head) {
+			pkt_buf_append_seg(queue->pkt_head, queue->pkt_tail, buf);
 		} else {
+			queue->pkt_head = buf;
+			buf->pkt_len = buf->size;
+		}
+		queue->pkt_tail = buf;
+		if (status & IXGBE_RXDADV_STAT_EOP) {
+			// offloading results are only complete in the descriptor with EOP set
+			rx_fill_meta(dev, queue_id, queue->pkt_head, &desc);
+			bufs[buf_index++] = queue->pkt_head;
+			queue->pkt_head = NULL;
+		}
+	}
+	queue->rx_index = rx_index;
+	return buf_index; // number of packets stored in bufs; buf_index points to the next index
+}
+
+uint32_t ixgbe_rx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	struct ixgbe_rx_queue* queue = get_rx_queue(dev, queue_id);
+	uint32_t num_rx = rx_process(dev, queue, queue_id, bufs, num_bufs);
+	// also retries descriptors that couldn't be refilled in previous calls
+	rx_refill(dev, queue, queue_id);
+	return num_rx;
+}
+
+// refill for the vector path: waits until RX_REFILL_BATCH descriptors are free and gets their bufs with bulk allocations
+// the nic only sees a new RDT once per batch, this saves most of the PCIe writes for RDT
+__attribute__((target("sse4.1")))
+static void rx_refill_bulk(struct ixgbe_device* dev, struct ixgbe_rx_queue* queue, uint16_t queue_id) {
+	uint16_t mask = queue->num_entries - 1;
+	uint16_t refill_index = queue->refill_index;
+	uint16_t pending = (queue->rx_index - refill_index) & mask;
+	if (pending < RX_REFILL_BATCH) {
+		return;
+	}
+	// bufs from the recycle ring are taken one ring batch at a time anyways
+	if (queue->recycle_ring) {
+		rx_refill(dev, queue, queue_id);
+		return;
+	}
+	struct pkt_buf* new_bufs[RX_REFILL_BATCH];
+	while (pending) {
+		uint32_t batch = pending < RX_REFILL_BATCH ? pending : RX_REFILL_BATCH;
+		uint32_t num_allocated = pkt_buf_alloc_batch(queue->mempool, new_bufs, batch);
+		for (uint32_t i = 0; i < num_allocated; i++) {
+			// a single 16 byte store for the address and the cleared flags (hdr_addr)
+			__m128i desc = _mm_set_epi64x(0, (int64_t) (new_bufs[i]->buf_addr_phy + offsetof(struct pkt_buf, data)));
+			_mm_store_si128((__m128i*) (queue->descriptors + refill_index), desc);
+			queue->virtual_addresses[refill_index] = new_bufs[i];
+			refill_index = (refill_index + 1) & mask;
+		}
+		if (num_allocated < batch) {
+			__atomic_add_fetch(&queue->refill_deferred, 1, __ATOMIC_RELAXED);
 			break;
 		}
+		pending -= batch;
 	}
-	if (rx_index != last_rx_index) {
-		// tell hardware that we are done
-		// this is intentionally off by one, otherwise we'd set RDT=RDH if we are receiving faster than packets are coming in
-		// RDT=RDH means queue is full
-		set_reg32(dev->addr, IXGBE_RDT(queue_id), last_rx_index);
-		queue->rx_index = rx_index;
+	if (refill_index != queue->refill_index) {
+		// off by one for the same reason as in rx_refill
+		set_reg32(dev->addr, IXGBE_RDT(queue_id), (refill_index - 1) & mask);
+		queue->refill_index = refill_index;
 	}
-	return buf_index; // number of packets stored in bufs; buf_index points to the next index
+}
+
+// vector rx path, selected at runtime if the cpu supports SSE4.1 (see init_process_state)
+// checks four descriptors at once: DD, EOP, and the lengths are extracted from the descriptors with shuffles
+// multi-segment packets and the rest of a burst that doesn't fill a group of four go through the scalar path
+__attribute__((target("sse4.1")))
+uint32_t ixgbe_rx_batch_vec(struct ixy_device* ixy, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	struct ixgbe_rx_queue* queue = get_rx_queue(dev, queue_id);
+	uint16_t mask = queue->num_entries - 1;
+	uint16_t rx_index = queue->rx_index;
+	uint32_t buf_index = 0;
+	const __m128i dd_bit = _mm_set1_epi32(IXGBE_RXDADV_STAT_DD);
+	const __m128i eop_bit = _mm_set1_epi32(IXGBE_RXDADV_STAT_EOP);
+	const __m128i len_mask = _mm_set1_epi32(0xFFFF);
+	// an incomplete chain from a previous call must be finished by the scalar path first
+	while (!queue->pkt_head && num_bufs - buf_index >= 4) {
+		// each descriptor is read with a single 16 byte load, so we never see DD with a partially written descriptor
+		__m128i d0 = _mm_load_si128((const __m128i*) (queue->descriptors + rx_index));
+		__m128i d1 = _mm_load_si128((const __m128i*) (queue->descriptors + ((rx_index + 1) & mask)));
+		__m128i d2 = _mm_load_si128((const __m128i*) (queue->descriptors + ((rx_index + 2) & mask)));
+		__m128i d3 = _mm_load_si128((const __m128i*) (queue->descriptors + ((rx_index + 3) & mask)));
+		// the upper 8 bytes of the write-back format are status_error (dword 2) and length/vlan (dword 3)
+		__m128i hi01 = _mm_unpackhi_epi32(d0, d1);
+		__m128i hi23 = _mm_unpackhi_epi32(d2, d3);
+		__m128i status = _mm_unpacklo_epi64(hi01, hi23);
+		__m128i lengths = _mm_and_si128(_mm_unpackhi_epi64(hi01, hi23), len_mask);
+		uint32_t dd = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(status, dd_bit), dd_bit)));
+		uint32_t eop = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(status, eop_bit), eop_bit)));
+		// only the run of done single-segment packets at the start of the group is handled here
+		// the descriptors after the first one that isn't done may still have a stale DD flag: they are waiting for a refill
+		uint32_t num_pkts = __builtin_ctz(~(dd & eop));
+		if (!num_pkts) {
+			break;
+		}
+		// packs the four 32 bit lengths into 16 bit words
+		uint16_t len[8];
+		_mm_storeu_si128((__m128i*) len, _mm_packus_epi32(lengths, lengths));
+		union ixgbe_adv_rx_desc descs[4];
+		_mm_storeu_si128((__m128i*) &descs[0], d0);
+		_mm_storeu_si128((__m128i*) &descs[1], d1);
+		_mm_storeu_si128((__m128i*) &descs[2], d2);
+		_mm_storeu_si128((__m128i*) &descs[3], d3);
+		for (uint32_t i = 0; i < num_pkts; i++) {
+			struct pkt_buf* buf = (struct pkt_buf*) queue->virtual_addresses[(rx_index + i) & mask];
+			buf->size = len[i];
+			buf->pkt_len = len[i];
+			buf->flags |= PKT_BUF_DIRTY;
+			rx_fill_meta(dev, queue_id, buf, &descs[i]);
+			bufs[buf_index++] = buf;
+		}
+		rx_index = (rx_index + num_pkts) & mask;
+		if (num_pkts < 4) {
+			break;
+		}
+	}
+	queue->rx_index = rx_index;
+	buf_index += rx_process(dev, queue, queue_id, bufs + buf_index, num_bufs - buf_index);
+	rx_refill_bulk(dev, queue, queue_id);
+	return buf_index;
+}
+
+// gives back sent bufs, in recycle mode directly to the rx queue they will be used by next
+static inline void tx_free_bufs(struct ixgbe_tx_queue* queue, struct pkt_buf* bufs[], uint32_t num_bufs) {
+	if (queue->recycle_ring) {
+		pkt_buf_recycle_seg_batch(queue->recycle_ring, bufs, num_bufs);
+	} else {
+		pkt_buf_free_seg_batch(bufs, num_bufs);
+	}
+}
+
+// gives back the bufs of the sent descriptors from clean_index up to (excluding) end, returns the new clean_index
+static inline uint16_t tx_clean(struct ixgbe_tx_queue* queue, uint16_t clean_index, uint16_t end) {
+	// each descriptor references a single segment of the packet, give back the whole batch at once
+	// this drops the queue's reference, bufs that are also queued elsewhere (pkt_buf_ref) stay alive
+	// the batch is one or two (on wrap-around) contiguous runs in virtual_addresses
+	struct pkt_buf** bufs = (struct pkt_buf**) queue->virtual_addresses;
+	if (end >= clean_index) {
+		tx_free_bufs(queue, bufs + clean_index, end - clean_index);
+	} else {
+		tx_free_bufs(queue, bufs + clean_index, queue->num_entries - clean_index);
+		tx_free_bufs(queue, bufs, end);
+	}
+	return end;
+}
+
+// writes the descriptor for one segment of a packet with a single 16 byte store
+// the last segment ends the packet (EOP), only the last packet of each clean batch reports its status (RS)
+// this is the descriptor the cleanup in ixgbe_tx_batch checks, all others don't need a write-back
+static inline void tx_write_desc(struct ixgbe_tx_queue* queue, uint16_t index, struct pkt_buf* seg, uint32_t pkt_len) {
+	// remember virtual address to clean it up later
+	queue->virtual_addresses[index] = (void*) seg;
+	// always the same flags: advanced data descriptor, CRC offload, data length
+	uint32_t cmd_type_len = IXGBE_ADVTXD_DCMD_IFCS | IXGBE_ADVTXD_DCMD_DEXT | IXGBE_ADVTXD_DTYP_DATA | seg->size;
+	if (!seg->next) {
+		cmd_type_len |= IXGBE_ADVTXD_DCMD_EOP;
+		if (((index - queue->rs_index) & (queue->num_entries - 1)) >= TX_CLEAN_BATCH - 1) {
+			cmd_type_len |= IXGBE_ADVTXD_DCMD_RS;
+			queue->rs_index = wrap_ring(index, queue->num_entries);
+		}
+	}
+	// no fancy offloading stuff - only the total payload length
+	// implement offloading flags here:
+	// 	* ip checksum offloading is trivial: just set the offset
+	// 	* tcp/udp checksum offloading is more annoying, you have to precalculate the pseudo-header checksum
+	uint32_t olinfo_status = pkt_len << IXGBE_ADVTXD_PAYLEN_SHIFT;
+	// NIC reads from buffer_addr, the upper half is cmd_type_len and olinfo_status
+	__m128i desc = _mm_set_epi64x((int64_t) ((uint64_t) olinfo_status << 32 | cmd_type_len), (int64_t) (seg->buf_addr_phy + offsetof(struct pkt_buf, data)));
+	_mm_store_si128((__m128i*) (queue->descriptors + index), desc);
 }
 
 // section 1.8.1 and 7.2
@@ -407,7 +989,7 @@ uint32_t ixgbe_rx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_bu
 // returns the number of packets transmitted, will not block when the queue is full
 uint32_t ixgbe_tx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
 	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
-	struct ixgbe_tx_queue* queue = ((struct ixgbe_tx_queue*)(dev->tx_queues)) + queue_id;
+	struct ixgbe_tx_queue* queue = get_tx_queue(dev, queue_id);
 	// the descriptor is explained in section 7.2.3.2.4
 	// we just use a struct copy & pasted from intel, but it basically has two formats (hence a union):
 	// 1. the write-back format which is written by the NIC once sending it is finished this is used in step 1
@@ -417,8 +999,12 @@ uint32_t ixgbe_tx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_bu
 
 	// step 1: clean up descriptors that were sent out by the hardware and return them to the mempool
 	// start by reading step 2 which is done first for each packet
-	// cleaning up must be done in batches for performance reasons, so this is unfortunately somewhat complicated
-	while (true) {
+	// with head write-back the nic tells us directly how far it got, everything before that can be cleaned at once
+	if (queue->head_wb) {
+		clean_index = tx_clean(queue, clean_index, (uint16_t) *queue->head_wb);
+	}
+	// otherwise cleaning up must be done in batches for performance reasons, so this is unfortunately somewhat complicated
+	while (!queue->head_wb) {
 		// figure out how many descriptors can be cleaned up
 		int32_t cleanable = queue->tx_index - clean_index; // tx_index is always ahead of clean (invariant of our queue)
 		if (cleanable < 0) { // handle wrap-around
@@ -433,21 +1019,17 @@ uint32_t ixgbe_tx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_bu
 		if (cleanup_to >= queue->num_entries) {
 			cleanup_to -= queue->num_entries;
 		}
+		// the batch must end on the last segment of a packet: tx_write_desc sets RS exactly on this descriptor
+		// packets are always queued completely, so this never moves past tx_index
+		while (((struct pkt_buf*) queue->virtual_addresses[cleanup_to])->next) {
+			cleanup_to = wrap_ring(cleanup_to, queue->num_entries);
+		}
 		volatile union ixgbe_adv_tx_desc* txd = queue->descriptors + cleanup_to;
 		uint32_t status = txd->wb.status;
 		// hardware sets this flag as soon as it's sent out, we can give back all bufs in the batch back to the mempool
 		if (status & IXGBE_ADVTXD_STAT_DD) {
-			int32_t i = clean_index;
-			while (true) {
-				struct pkt_buf* buf = queue->virtual_addresses[i];
-				pkt_buf_free(buf);
-				if (i == cleanup_to) {
-					break;
-				}
-				i = wrap_ring(i, queue->num_entries);
-			}
 			// next descriptor to be cleaned up is one after the one we just cleaned
-			clean_index = wrap_ring(cleanup_to, queue->num_entries);
+			clean_index = tx_clean(queue, clean_index, wrap_ring(cleanup_to, queue->num_entries));
 		} else {
 			// clean the whole batch or nothing; yes, this leaves some packets in
 			// the queue forever if you stop transmitting, but that's not a real concern
@@ -457,32 +1039,65 @@ uint32_t ixgbe_tx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_bu
 	queue->clean_index = clean_index;
 
 	// step 2: send out as many of our packets as possible
-	uint32_t sent;
-	for (sent = 0; sent < num_bufs; sent++) {
-		uint32_t next_index = wrap_ring(queue->tx_index, queue->num_entries);
-		// we are full if the next index is the one we are trying to reclaim
-		if (clean_index == next_index) {
-			break;
+	// we are full if the next index is the one we are trying to reclaim, i.e., one descriptor always stays empty
+	uint16_t tx_index = queue->tx_index;
+	uint32_t free_descs = (clean_index - tx_index - 1) & (queue->num_entries - 1);
+	uint32_t sent = 0;
+	// fast path: groups of four single-segment packets, the common case
+	while (num_bufs - sent >= 4 && free_descs >= 4
+			&& !bufs[sent]->next && !bufs[sent + 1]->next && !bufs[sent + 2]->next && !bufs[sent + 3]->next) {
+		for (int i = 0; i < 4; i++) {
+			tx_write_desc(queue, tx_index, bufs[sent + i], bufs[sent + i]->size);
+			tx_index = wrap_ring(tx_index, queue->num_entries);
 		}
+		sent += 4;
+		free_descs -= 4;
+	}
+	// the rest of the batch and multi-segment packets
+	for (; sent < num_bufs; sent++) {
 		struct pkt_buf* buf = bufs[sent];
-		// remember virtual address to clean it up later
-		queue->virtual_addresses[queue->tx_index] = (void*) buf;
-		volatile union ixgbe_adv_tx_desc* txd = queue->descriptors + queue->tx_index;
-		queue->tx_index = next_index;
-		// NIC reads from here
-		txd->read.buffer_addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data);
-		// always the same flags: one buffer (EOP), advanced data descriptor, CRC offload, data length
-		txd->read.cmd_type_len =
-			IXGBE_ADVTXD_DCMD_EOP | IXGBE_ADVTXD_DCMD_RS | IXGBE_ADVTXD_DCMD_IFCS | IXGBE_ADVTXD_DCMD_DEXT | IXGBE_ADVTXD_DTYP_DATA | buf->size;
-		// no fancy offloading stuff - only the total payload length
-		// implement offloading flags here:
-		// 	* ip checksum offloading is trivial: just set the offset
-		// 	* tcp/udp checksum offloading is more annoying, you have to precalculate the pseudo-header checksum
-		txd->read.olinfo_status = buf->size << IXGBE_ADVTXD_PAYLEN_SHIFT;
+		// each segment of the packet needs its own descriptor
+		uint32_t num_segs = 0;
+		uint32_t pkt_len = 0;
+		for (struct pkt_buf* seg = buf; seg; seg = seg->next) {
+			num_segs++;
+			pkt_len += seg->size;
+		}
+		if (num_segs > free_descs) {
+			break;
+		}
+		for (struct pkt_buf* seg = buf; seg; seg = seg->next) {
+			tx_write_desc(queue, tx_index, seg, pkt_len);
+			tx_index = wrap_ring(tx_index, queue->num_entries);
+		}
+		free_descs -= num_segs;
 	}
+	// the head is only written back for descriptors with RS, without this the last few packets would stay in the
+	// queue until the next clean batch is complete
+	if (queue->head_wb && tx_index != queue->tx_index && queue->rs_index != tx_index) {
+		uint16_t last = (tx_index - 1) & (queue->num_entries - 1);
+		queue->descriptors[last].read.cmd_type_len |= IXGBE_ADVTXD_DCMD_RS;
+		queue->rs_index = tx_index;
+	}
+	queue->tx_index = tx_index;
 	// send out by advancing tail, i.e., pass control of the bufs to the nic
 	// this seems like a textbook case for a release memory order, but Intel's driver doesn't even use a compiler barrier here
 	set_reg32(dev->addr, IXGBE_TDT(queue_id), queue->tx_index);
 	return sent;
 }
 
+// the ring is created on first use and can hold all bufs of a full tx queue
+struct recycle_ring* ixgbe_get_rx_recycle_ring(struct ixy_device* ixy, uint16_t queue_id) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	struct ixgbe_rx_queue* queue = get_rx_queue(dev, queue_id);
+	if (!queue->recycle_ring) {
+		queue->recycle_ring = recycle_ring_create(queue->mempool, NUM_TX_QUEUE_ENTRIES);
+	}
+	return queue->recycle_ring;
+}
+
+void ixgbe_set_tx_recycle_ring(struct ixy_device* ixy, uint16_t queue_id, struct recycle_ring* ring) {
+	struct ixgbe_device* dev = IXY_TO_IXGBE(ixy);
+	struct ixgbe_tx_queue* queue = get_tx_queue(dev, queue_id);
+	queue->recycle_ring = ring;
+}
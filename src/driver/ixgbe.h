@@ -10,15 +10,28 @@ struct ixgbe_device {
     uint8_t* addr;
     void* rx_queues;
     void* tx_queues;
+    // rx queues use larger mempool entries if jumbo frames are enabled
+    bool jumbo_frames;
+    // flow director is configured when the first filter is added, all filters share its mode and fields
+    bool fdir_enabled;
+    uint8_t fdir_mode;
+    uint8_t fdir_fields;
 };
 
 #define IXY_TO_IXGBE(ixy_device) container_of(ixy_device, struct ixgbe_device, ixy)
 
 struct ixy_device* ixgbe_init(const char* pci_addr, uint16_t rx_queues, uint16_t tx_queues);
+struct ixy_device* ixgbe_attach(const char* pci_addr, struct ixy_device* shared);
 uint32_t ixgbe_get_link_speed(const struct ixy_device* dev);
 void ixgbe_set_promisc(struct ixy_device* dev, bool enabled);
 void ixgbe_read_stats(struct ixy_device* dev, struct device_stats* stats);
 uint32_t ixgbe_tx_batch(struct ixy_device* dev, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs);
 uint32_t ixgbe_rx_batch(struct ixy_device* dev, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs);
+uint32_t ixgbe_rx_batch_vec(struct ixy_device* dev, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs);
+struct recycle_ring* ixgbe_get_rx_recycle_ring(struct ixy_device* dev, uint16_t queue_id);
+void ixgbe_set_rss(struct ixy_device* dev, const uint8_t* key, uint32_t fields);
+uint32_t ixgbe_add_filters(struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters);
+uint32_t ixgbe_remove_filters(struct ixy_device* dev, const struct ixy_flow_filter filters[], uint32_t num_filters);
+void ixgbe_set_tx_recycle_ring(struct ixy_device* dev, uint16_t queue_id, struct recycle_ring* ring);
 
 #endif //IXY_IXGBE_H
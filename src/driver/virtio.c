@@ -12,64 +12,182 @@
 
 static const char* driver_name = "ixy-virtio";
 
-static inline void virtio_legacy_notify_queue(struct virtio_device* dev, uint16_t idx) {
-	write_io16(dev->fd, idx, VIRTIO_PCI_QUEUE_NOTIFY);
+// rx descriptors are refilled with bufs from bulk allocations of this size
+#define RX_REFILL_BATCH 32
+
+// legacy registers are in an io bar: direct port i/o if we have the privileges, pread/pwrite on the sysfs resource otherwise
+static inline void virtio_legacy_write32(struct virtio_device* dev, uint32_t value, size_t offset) {
+	if (dev->io_port) {
+		write_port32(dev->io_port, value, offset);
+	} else {
+		write_io32(dev->fd, value, offset);
+	}
+}
+
+static inline void virtio_legacy_write16(struct virtio_device* dev, uint16_t value, size_t offset) {
+	if (dev->io_port) {
+		write_port16(dev->io_port, value, offset);
+	} else {
+		write_io16(dev->fd, value, offset);
+	}
+}
+
+static inline void virtio_legacy_write8(struct virtio_device* dev, uint8_t value, size_t offset) {
+	if (dev->io_port) {
+		write_port8(dev->io_port, value, offset);
+	} else {
+		write_io8(dev->fd, value, offset);
+	}
+}
+
+static inline uint32_t virtio_legacy_read32(struct virtio_device* dev, size_t offset) {
+	return dev->io_port ? read_port32(dev->io_port, offset) : read_io32(dev->fd, offset);
+}
+
+static inline uint16_t virtio_legacy_read16(struct virtio_device* dev, size_t offset) {
+	return dev->io_port ? read_port16(dev->io_port, offset) : read_io16(dev->fd, offset);
+}
+
+static inline uint8_t virtio_legacy_read8(struct virtio_device* dev, size_t offset) {
+	return dev->io_port ? read_port8(dev->io_port, offset) : read_io8(dev->fd, offset);
+}
+
+// modern devices use memory bars, 64 bit fields are written as two 32 bit halves - Section 4.1.3.1
+static inline void virtio_modern_write64(struct virtio_device* dev, uint64_t value, int offset) {
+	set_reg32(dev->common_cfg, offset, (uint32_t) value);
+	set_reg32(dev->common_cfg, offset + 4, (uint32_t) (value >> 32));
+}
+
+static inline void virtio_notify_queue(struct virtio_device* dev, struct virtqueue* vq, uint16_t idx) {
+	if (dev->modern) {
+		// Section 4.1.4.4: every queue has its own doorbell, a single mmio write
+		set_reg16(dev->notify_base, vq->notification_offset, idx);
+	} else {
+		virtio_legacy_write16(dev, idx, VIRTIO_PCI_QUEUE_NOTIFY);
+	}
+}
+
+// Notifies the device about new available descriptors unless it asked us not to - Section 2.4.7
+// Each notification is a vm exit (and a syscall without direct port i/o), so this is only done once per batch
+// With event indices the device tells us the avail index it wants a kick for, old_avail_idx is the index before the batch
+static inline void virtio_kick(struct virtio_device* dev, struct virtqueue* vq, uint16_t idx, uint16_t old_avail_idx) {
+	// The index update must be visible before we read the event/flags, otherwise we could miss that the device wants a kick
+	_mm_mfence();
+	bool notify = dev->event_idx
+		? vring_need_event(vring_avail_event(&vq->vring), vq->vring.avail->idx, old_avail_idx)
+		: !(vq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
+	if (notify) {
+		virtio_notify_queue(dev, vq, idx);
+	}
+}
+
+// We poll and don't want interrupts, but with event indices the device ignores VRING_AVAIL_F_NO_INTERRUPT
+// It interrupts once the used index passes the used event instead, keeping that half the index space ahead of the
+// last used index means that it's never reached: the device can't be more than a ring size ahead of us
+static inline void virtio_suppress_interrupts(struct virtqueue* vq) {
+	vring_used_event(&vq->vring) = vq->vq_used_last_idx + 0x8000;
 }
 
 static uint8_t virtio_legacy_get_status(struct virtio_device* dev) {
-	return read_io8(dev->fd, VIRTIO_PCI_STATUS);
+	return virtio_legacy_read8(dev, VIRTIO_PCI_STATUS);
 }
 
 static void virtio_legacy_check_status(struct virtio_device* dev) {
-	if (read_io8(dev->fd, VIRTIO_PCI_STATUS) == VIRTIO_CONFIG_STATUS_FAILED) {
+	if (virtio_legacy_read8(dev, VIRTIO_PCI_STATUS) == VIRTIO_CONFIG_STATUS_FAILED) {
 		error("Device signaled unrecoverable error");
 	}
 }
 
-static inline size_t virtio_legacy_vring_size(unsigned int num, unsigned long align) {
+static inline size_t virtio_vring_size(unsigned int num, unsigned long align) {
 	size_t size;
 
+	// Section 2.4.2: the avail ring is followed by the used event, the used ring by the avail event
 	size = num * sizeof(struct vring_desc);
-	size += sizeof(struct vring_avail) + (num * sizeof(uint16_t));
+	size += sizeof(struct vring_avail) + (num * sizeof(uint16_t)) + sizeof(uint16_t);
 	size = RTE_ALIGN_CEIL(size, align);
-	size += sizeof(struct vring_used) + (num * sizeof(struct vring_used_elem));
+	size += sizeof(struct vring_used) + (num * sizeof(struct vring_used_elem)) + sizeof(uint16_t);
 	return size;
 }
 
-static inline void virtio_legacy_vring_init(struct vring* vr, unsigned int num, uint8_t* p, unsigned long align) {
+static inline void virtio_vring_init(struct vring* vr, unsigned int num, uint8_t* p, unsigned long align) {
 	vr->num = num;
 	vr->desc = (struct vring_desc*)p;
 	vr->avail = (struct vring_avail*)(p + num * sizeof(struct vring_desc));
-	vr->used = (void*)RTE_ALIGN_CEIL((uintptr_t)(&vr->avail->ring[num]), align);
+	// Skip the used event behind the avail ring
+	vr->used = (void*)RTE_ALIGN_CEIL((uintptr_t)(&vr->avail->ring[num + 1]), align);
 }
 
-static void virtio_legacy_setup_tx_queue(struct virtio_device* dev, uint16_t idx) {
+// Free descriptors are kept in a list linked via their next field, so we never need to search the descriptor table
+// The caller must check num_free before taking a descriptor
+static inline uint16_t virtq_get_desc(struct virtqueue* vq) {
+	uint16_t idx = vq->free_head;
+	vq->free_head = vq->vring.desc[idx].next;
+	vq->num_free--;
+	return idx;
+}
+
+static inline void virtq_put_desc(struct virtqueue* vq, uint16_t idx) {
+	vq->vring.desc[idx].next = vq->free_head;
+	vq->free_head = idx;
+	vq->num_free++;
+}
+
+// selects a queue for the following queue configuration and returns its size, 0 if the queue doesn't exist
+static uint16_t virtio_select_queue(struct virtio_device* dev, uint16_t idx) {
+	if (dev->modern) {
+		// modern devices would also let us pick a smaller size, we always use the maximum
+		set_reg16(dev->common_cfg, VIRTIO_PCI_COMMON_Q_SELECT, idx);
+		return get_reg16(dev->common_cfg, VIRTIO_PCI_COMMON_Q_SIZE);
+	}
+	virtio_legacy_write16(dev, idx, VIRTIO_PCI_QUEUE_SEL);
+	return virtio_legacy_read16(dev, VIRTIO_PCI_QUEUE_NUM);
+}
+
+// hands the initialized rings of the selected queue to the device - Section 4.1.5.1.3
+static void virtio_activate_queue(struct virtio_device* dev, struct virtqueue* vq, struct dma_memory mem) {
+	if (dev->modern) {
+		// the three parts of the ring are configured separately, we just use the legacy layout
+		virtio_modern_write64(dev, mem.phy, VIRTIO_PCI_COMMON_Q_DESCLO);
+		virtio_modern_write64(dev, mem.phy + ((uint8_t*) vq->vring.avail - (uint8_t*) mem.virt), VIRTIO_PCI_COMMON_Q_AVAILLO);
+		virtio_modern_write64(dev, mem.phy + ((uint8_t*) vq->vring.used - (uint8_t*) mem.virt), VIRTIO_PCI_COMMON_Q_USEDLO);
+		vq->notification_offset = get_reg16(dev->common_cfg, VIRTIO_PCI_COMMON_Q_NOFF) * dev->notify_off_multiplier;
+		set_reg16(dev->common_cfg, VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+	} else {
+		if (mem.phy & ((1 << VIRTIO_PCI_QUEUE_ADDR_SHIFT) - 1)) {
+			error("virt queue at physical address 0x%lx is not page-aligned", mem.phy);
+		}
+		virtio_legacy_write32(dev, mem.phy >> VIRTIO_PCI_QUEUE_ADDR_SHIFT, VIRTIO_PCI_QUEUE_PFN);
+		vq->notification_offset = virtio_legacy_read16(dev, VIRTIO_PCI_QUEUE_NOTIFY);
+	}
+	debug("vq notification offset %lu", vq->notification_offset);
+}
+
+static void virtio_setup_tx_queue(struct virtio_device* dev, uint16_t idx) {
 	if (idx != 1 && idx != 2) {
 		error("Can't setup queue %u as Tx queue", idx);
 	}
 
 	// Create virt queue itself - Section 4.1.5.1.3
-	write_io16(dev->fd, idx, VIRTIO_PCI_QUEUE_SEL);
-	uint32_t max_queue_size = read_io32(dev->fd, VIRTIO_PCI_QUEUE_NUM);
+	uint32_t max_queue_size = virtio_select_queue(dev, idx);
 	debug("Max queue size of tx queue #%u: %u", idx, max_queue_size);
 	if (max_queue_size == 0) {
 		return;
 	}
-	size_t virt_queue_mem_size = virtio_legacy_vring_size(max_queue_size, 4096);
-	struct dma_memory mem = memory_allocate_dma(virt_queue_mem_size, true);
+	size_t virt_queue_mem_size = virtio_vring_size(max_queue_size, VIRTIO_PCI_VRING_ALIGN);
+	// legacy devices only take the page number of the ring
+	struct dma_memory mem = memory_allocate_dma_aligned(virt_queue_mem_size, true, dev->ixy.numa_node, VIRTIO_PCI_VRING_ALIGN);
 	memset(mem.virt, 0xab, virt_queue_mem_size);
 	debug("Allocated %zu bytes for virt queue at %p", virt_queue_mem_size, mem.virt);
-	write_io32(dev->fd, mem.phy >> VIRTIO_PCI_QUEUE_ADDR_SHIFT, VIRTIO_PCI_QUEUE_PFN);
 
 	// Section 2.4.2 for layout
 	struct virtqueue* vq = calloc(1, sizeof(*vq) + sizeof(void*) * max_queue_size);
-	virtio_legacy_vring_init(&vq->vring, max_queue_size, mem.virt, 4096);
+	virtio_vring_init(&vq->vring, max_queue_size, mem.virt, VIRTIO_PCI_VRING_ALIGN);
 	debug("vring desc: %p, vring avail: %p, vring used: %p", vq->vring.desc, vq->vring.avail, vq->vring.used);
 	for (size_t i = 0; i < vq->vring.num; ++i) {
 		vq->vring.desc[i].len = 0;
 		vq->vring.desc[i].addr = 0;
 		vq->vring.desc[i].flags = 0;
-		vq->vring.desc[i].next = 0;
+		vq->vring.desc[i].next = i + 1;
 		vq->vring.avail->ring[i] = 0;
 		vq->vring.used->ring[i].id = 0;
 		vq->vring.used->ring[i].len = 0;
@@ -77,20 +195,20 @@ static void virtio_legacy_setup_tx_queue(struct virtio_device* dev, uint16_t idx
 	vq->vring.used->idx = 0;
 	vq->vring.avail->idx = 0;
 	vq->vq_used_last_idx = 0;
-
-	// Section 4.1.4.4
-	uint32_t notify_offset = read_io16(dev->fd, VIRTIO_PCI_QUEUE_NOTIFY);
-	debug("vq notifcation offset %u", notify_offset);
-	vq->notification_offset = notify_offset;
+	// All descriptors start out free
+	vq->free_head = 0;
+	vq->num_free = vq->vring.num;
 
 	// Ctrl queue packets are not supplied by the user
 	if (idx == 2) {
-		vq->mempool = memory_allocate_mempool(max_queue_size, 2048);
+		vq->mempool = memory_allocate_mempool_node(max_queue_size, 2048, dev->ixy.numa_node);
 	}
 
 	// Disable interrupts - Section 2.4.7
 	vq->vring.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
 	vq->vring.used->flags = 0;
+	virtio_suppress_interrupts(vq);
+	virtio_activate_queue(dev, vq, mem);
 
 	if (idx == 1) {
 		dev->tx_queue = vq;
@@ -99,7 +217,7 @@ static void virtio_legacy_setup_tx_queue(struct virtio_device* dev, uint16_t idx
 	}
 }
 
-static void virtio_legacy_send_command(struct virtio_device* dev, void* cmd, size_t cmd_len) {
+static void virtio_send_command(struct virtio_device* dev, void* cmd, size_t cmd_len) {
 	struct virtqueue* vq = dev->ctrl_queue;
 
 	if (cmd_len < sizeof(struct virtio_net_ctrl_hdr)) {
@@ -110,19 +228,14 @@ static void virtio_legacy_send_command(struct virtio_device* dev, void* cmd, siz
 	}
 
 	_mm_mfence();
-	// Find free desciptor slot
-	uint16_t idx = 0;
-	for (idx = 0; idx < vq->vring.num; ++idx) {
-		struct vring_desc* desc = &vq->vring.desc[idx];
-		if (desc->addr == 0) {
-			break;
-		}
-	}
-	if (idx == vq->vring.num) {
+	// Header, payload, and ack each get a descriptor
+	if (vq->num_free < 3) {
 		error("command queue full");
-	} else {
-		debug("Found free desc slot at %u (%u)", idx, vq->vring.num);
 	}
+	uint16_t idx = virtq_get_desc(vq);
+	uint16_t data_idx = virtq_get_desc(vq);
+	uint16_t ack_idx = virtq_get_desc(vq);
+	debug("Using desc slots %u, %u, %u (%u)", idx, data_idx, ack_idx, vq->vring.num);
 
 	struct pkt_buf* buf = pkt_buf_alloc(vq->mempool);
 	if (!buf) {
@@ -145,23 +258,23 @@ static void virtio_legacy_send_command(struct virtio_device* dev, void* cmd, siz
 	vq->vring.desc[idx].len = 2;
 	vq->vring.desc[idx].addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data);
 	vq->vring.desc[idx].flags = VRING_DESC_F_NEXT;
-	vq->vring.desc[idx].next = idx + 1;
+	vq->vring.desc[idx].next = data_idx;
 	// Device-readable payload: data
-	vq->vring.desc[idx + 1].len = cmd_len - 2 - 1; // Header and ack byte
-	vq->vring.desc[idx + 1].addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data) + 2;
-	vq->vring.desc[idx + 1].flags = VRING_DESC_F_NEXT;
-	vq->vring.desc[idx + 1].next = idx + 2;
+	vq->vring.desc[data_idx].len = cmd_len - 2 - 1; // Header and ack byte
+	vq->vring.desc[data_idx].addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data) + 2;
+	vq->vring.desc[data_idx].flags = VRING_DESC_F_NEXT;
+	vq->vring.desc[data_idx].next = ack_idx;
 	// Device-writable tail: ack flag
-	vq->vring.desc[idx + 2].len = 1;
-	vq->vring.desc[idx + 2].addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data) + cmd_len - 1;
-	vq->vring.desc[idx + 2].flags = VRING_DESC_F_WRITE;
-	vq->vring.desc[idx + 2].next = 0;
+	vq->vring.desc[ack_idx].len = 1;
+	vq->vring.desc[ack_idx].addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data) + cmd_len - 1;
+	vq->vring.desc[ack_idx].flags = VRING_DESC_F_WRITE;
+	vq->vring.desc[ack_idx].next = 0;
 	vq->vring.avail->ring[vq->vring.avail->idx % vq->vring.num] = idx;
 	_mm_mfence();
 	vq->vring.avail->idx++;
 	_mm_mfence();
 
-	virtio_legacy_notify_queue(dev, 2);
+	virtio_notify_queue(dev, vq, 2);
 	_mm_mfence();
 
 	// Wait until the buffer got processed
@@ -170,9 +283,10 @@ static void virtio_legacy_send_command(struct virtio_device* dev, void* cmd, siz
 		debug("Waiting...");
 		usleep(100000);
 	}
-	vq->vq_used_last_idx++;
 	// Check status and free buffer
-	struct vring_used_elem* e = &vq->vring.used->ring[vq->vring.used->idx];
+	struct vring_used_elem* e = &vq->vring.used->ring[vq->vq_used_last_idx % vq->vring.num];
+	vq->vq_used_last_idx++;
+	virtio_suppress_interrupts(vq);
 	debug("e %p: id %u len %u", e, e->id, e->len);
 	if (e->id != idx) {
 		error("Used buffer has different index as sent one");
@@ -181,12 +295,12 @@ static void virtio_legacy_send_command(struct virtio_device* dev, void* cmd, siz
 		error("buffer differ");
 	}
 	pkt_buf_free(buf);
-	vq->vring.desc[idx] = (struct vring_desc){};
-	vq->vring.desc[idx + 1] = (struct vring_desc){};
-	vq->vring.desc[idx + 2] = (struct vring_desc){};
+	virtq_put_desc(vq, ack_idx);
+	virtq_put_desc(vq, data_idx);
+	virtq_put_desc(vq, idx);
 }
 
-static void virtio_legacy_set_promiscuous(struct virtio_device* dev, bool on) {
+static void virtio_set_promiscuous(struct virtio_device* dev, bool on) {
 	struct {
 		struct virtio_net_ctrl_hdr hdr;
 		uint8_t on;
@@ -198,54 +312,64 @@ static void virtio_legacy_set_promiscuous(struct virtio_device* dev, bool on) {
 	cmd.hdr.cmd = VIRTIO_NET_CTRL_RX_PROMISC;
 	cmd.on = on ? 1 : 0;
 
-	virtio_legacy_send_command(dev, &cmd, sizeof(cmd));
+	virtio_send_command(dev, &cmd, sizeof(cmd));
 	info("Set promisc to %u", on);
 }
 
 void virtio_set_promisc(struct ixy_device* ixy, bool enabled) {
 	struct virtio_device* dev = IXY_TO_VIRTIO(ixy);
-	virtio_legacy_set_promiscuous(dev, enabled);
+	virtio_set_promiscuous(dev, enabled);
 }
 
 uint32_t virtio_get_link_speed(const struct ixy_device* dev) {
 	return 1000;
 }
 
-static const struct virtio_legacy_net_hdr net_hdr = {
-	.flags = 0,
-	.gso_type = VIRTIO_NET_HDR_GSO_NONE,
-	.hdr_len = 14 + 20 + 8,
+// only the first net_hdr_len bytes are used, num_buffers is only there with VIRTIO_NET_F_MRG_RXBUF or VIRTIO_F_VERSION_1
+static const struct virtio_legacy_net_hdr_mrg_rxbuf net_hdr = {
+	.hdr = {
+		.flags = 0,
+		.gso_type = VIRTIO_NET_HDR_GSO_NONE,
+		.hdr_len = 14 + 20 + 8,
+	},
+	.num_buffers = 0,
 };
 
-static void virtio_legacy_setup_rx_queue(struct virtio_device* dev, uint16_t idx) {
+// the net header is placed in the head room directly in front of the packet data
+static inline void* net_hdr_virt(struct virtio_device* dev, struct pkt_buf* buf) {
+	return buf->head_room + sizeof(buf->head_room) - dev->net_hdr_len;
+}
+
+static inline uint64_t net_hdr_phy(struct virtio_device* dev, struct pkt_buf* buf) {
+	return buf->buf_addr_phy + offsetof(struct pkt_buf, data) - dev->net_hdr_len;
+}
+
+static void virtio_setup_rx_queue(struct virtio_device* dev, uint16_t idx) {
 	if (idx != 0) {
 		error("Can't setup Tx queue as Rx");
 	}
 
 	// Create virt queue itself - Section 4.1.5.1.3
-	write_io16(dev->fd, idx, VIRTIO_PCI_QUEUE_SEL);
-	uint32_t max_queue_size = read_io32(dev->fd, VIRTIO_PCI_QUEUE_NUM);
+	uint32_t max_queue_size = virtio_select_queue(dev, idx);
 	debug("Max queue size of rx queue #%u: %u", idx, max_queue_size);
 	if (max_queue_size == 0) {
 		return;
 	}
-	uint32_t notify_offset = read_io16(dev->fd, VIRTIO_PCI_QUEUE_NOTIFY);
-	debug("Notifcation offset %u", notify_offset);
-	size_t virt_queue_mem_size = virtio_legacy_vring_size(max_queue_size, 4096);
-	struct dma_memory mem = memory_allocate_dma(virt_queue_mem_size, true);
+	size_t virt_queue_mem_size = virtio_vring_size(max_queue_size, VIRTIO_PCI_VRING_ALIGN);
+	// legacy devices only take the page number of the ring
+	struct dma_memory mem = memory_allocate_dma_aligned(virt_queue_mem_size, true, dev->ixy.numa_node, VIRTIO_PCI_VRING_ALIGN);
 	memset(mem.virt, 0xab, virt_queue_mem_size);
 	debug("Allocated %zu bytes for virt queue at %p", virt_queue_mem_size, mem.virt);
-	write_io32(dev->fd, mem.phy >> VIRTIO_PCI_QUEUE_ADDR_SHIFT, VIRTIO_PCI_QUEUE_PFN);
 
 	// Section 2.4.2 for layout
 	struct virtqueue* vq = calloc(1, sizeof(*vq) + sizeof(void*) * max_queue_size);
-	virtio_legacy_vring_init(&vq->vring, max_queue_size, mem.virt, 4096);
+	virtio_vring_init(&vq->vring, max_queue_size, mem.virt, VIRTIO_PCI_VRING_ALIGN);
 	debug("vring desc: %p, vring avail: %p, vring used: %p", vq->vring.desc, vq->vring.avail, vq->vring.used);
 	for (size_t i = 0; i < vq->vring.num; ++i) {
 		vq->vring.desc[i].len = 0;
 		vq->vring.desc[i].addr = 0;
 		vq->vring.desc[i].flags = 0;
-		vq->vring.desc[i].next = 0;
+		vq->vring.desc[i].next = i + 1;
 		vq->vring.avail->ring[i] = 0;
 		vq->vring.used->ring[i].id = 0;
 		vq->vring.used->ring[i].len = 0;
@@ -253,18 +377,20 @@ static void virtio_legacy_setup_rx_queue(struct virtio_device* dev, uint16_t idx
 	vq->vring.used->idx = 0;
 	vq->vring.avail->idx = 0;
 	vq->vq_used_last_idx = 0;
-
-	// Section 4.1.4.4
-	vq->notification_offset = notify_offset;
+	// All descriptors start out free
+	vq->free_head = 0;
+	vq->num_free = vq->vring.num;
 
 	// Disable interrupts - Section 2.4.7
 	vq->vring.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
 	vq->vring.used->flags = 0;
+	virtio_suppress_interrupts(vq);
+	virtio_activate_queue(dev, vq, mem);
 
 	// Allocate buffers and fill descriptor table - Section 3.2.1
 	// We allocate more bufs than what would fit in the queue,
 	// because we don't want to stall rx if users hold bufs for longer
-	vq->mempool = memory_allocate_mempool(max_queue_size * 4, 2048);
+	vq->mempool = memory_allocate_mempool_node(max_queue_size * 4, 2048, dev->ixy.numa_node);
 
 	dev->rx_queue = vq;
 }
@@ -272,14 +398,14 @@ static void virtio_legacy_setup_rx_queue(struct virtio_device* dev, uint16_t idx
 static void virtio_legacy_init(struct virtio_device* dev) {
 	// Section 3.1
 	debug("Configuring bar0");
-	write_io8(dev->fd, VIRTIO_CONFIG_STATUS_RESET, VIRTIO_PCI_STATUS);
-	while (read_io8(dev->fd, VIRTIO_PCI_STATUS) != VIRTIO_CONFIG_STATUS_RESET) {
+	virtio_legacy_write8(dev, VIRTIO_CONFIG_STATUS_RESET, VIRTIO_PCI_STATUS);
+	while (virtio_legacy_read8(dev, VIRTIO_PCI_STATUS) != VIRTIO_CONFIG_STATUS_RESET) {
 		usleep(100);
 	}
-	write_io8(dev->fd, VIRTIO_CONFIG_STATUS_ACK, VIRTIO_PCI_STATUS);
-	write_io8(dev->fd, VIRTIO_CONFIG_STATUS_DRIVER, VIRTIO_PCI_STATUS);
+	virtio_legacy_write8(dev, VIRTIO_CONFIG_STATUS_ACK, VIRTIO_PCI_STATUS);
+	virtio_legacy_write8(dev, VIRTIO_CONFIG_STATUS_DRIVER, VIRTIO_PCI_STATUS);
 	// Negotiate features
-	uint32_t host_features = read_io32(dev->fd, VIRTIO_PCI_HOST_FEATURES);
+	uint32_t host_features = virtio_legacy_read32(dev, VIRTIO_PCI_HOST_FEATURES);
 	debug("Host features: %x", host_features);
 	if (!(host_features & VIRTIO_F_VERSION_1)) {
 		error("In legacy mode but device is not legacy");
@@ -290,21 +416,141 @@ static void virtio_legacy_init(struct virtio_device* dev) {
 	if ((host_features & required_features) != required_features) {
 		error("Device does not support required features");
 	}
-	debug("Guest features before negotiation: %x", read_io32(dev->fd, VIRTIO_PCI_GUEST_FEATURES));
-	write_io32(dev->fd, required_features, VIRTIO_PCI_GUEST_FEATURES);
-	debug("Guest features after negotiation: %x", read_io32(dev->fd, VIRTIO_PCI_GUEST_FEATURES));
+	uint32_t guest_features = required_features;
+	// mergeable rx buffers allow receiving packets larger than a single buf as a chain of bufs (e.g., jumbo frames)
+	if (host_features & (1u << VIRTIO_NET_F_MRG_RXBUF)) {
+		guest_features |= 1u << VIRTIO_NET_F_MRG_RXBUF;
+		dev->mrg_rxbuf = true;
+		dev->net_hdr_len = sizeof(struct virtio_legacy_net_hdr_mrg_rxbuf);
+	} else {
+		dev->net_hdr_len = sizeof(struct virtio_legacy_net_hdr);
+	}
+	// event indices let the device tell us when it actually needs a notification, see virtio_kick
+	if (host_features & (1u << VIRTIO_RING_F_EVENT_IDX)) {
+		guest_features |= 1u << VIRTIO_RING_F_EVENT_IDX;
+		dev->event_idx = true;
+	}
+	debug("Guest features before negotiation: %x", virtio_legacy_read32(dev, VIRTIO_PCI_GUEST_FEATURES));
+	virtio_legacy_write32(dev, guest_features, VIRTIO_PCI_GUEST_FEATURES);
+	debug("Guest features after negotiation: %x", virtio_legacy_read32(dev, VIRTIO_PCI_GUEST_FEATURES));
 	// Queue setup - Section 5.1.2 for queue index calculation
 	// Legacy devices only have 3 queues
-	virtio_legacy_setup_rx_queue(dev, 0); // Rx
-	virtio_legacy_setup_tx_queue(dev, 1); // Tx
-	virtio_legacy_setup_tx_queue(dev, 2); // Control
+	virtio_setup_rx_queue(dev, 0); // Rx
+	virtio_setup_tx_queue(dev, 1); // Tx
+	virtio_setup_tx_queue(dev, 2); // Control
 	_mm_mfence();
 	// Signal OK
-	write_io8(dev->fd, VIRTIO_CONFIG_STATUS_DRIVER_OK, VIRTIO_PCI_STATUS);
+	virtio_legacy_write8(dev, VIRTIO_CONFIG_STATUS_DRIVER_OK, VIRTIO_PCI_STATUS);
 	info("Setup complete");
 	// Recheck status
 	virtio_legacy_check_status(dev);
-	virtio_legacy_set_promiscuous(dev, true);
+	virtio_set_promiscuous(dev, true);
+}
+
+// Section 4.1.4: the structures of a modern device are located via vendor-specific capabilities in the pci config space
+static void virtio_modern_map_caps(struct virtio_device* dev, const char* pci_addr) {
+	int config = pci_open_resource(pci_addr, "config");
+	if (!(read_io16(config, PCI_STATUS) & PCI_STATUS_CAP_LIST)) {
+		error("Device has no capability list");
+	}
+	uint8_t* bars[6] = {};
+	uint8_t pos = read_io8(config, PCI_CAPABILITY_LIST) & ~3;
+	// the list is terminated by 0, the bound on the number of entries protects against malformed (circular) lists
+	for (int i = 0; pos && i < 48; i++) {
+		uint8_t next = read_io8(config, pos + VIRTIO_PCI_CAP_NEXT) & ~3;
+		if (read_io8(config, pos + VIRTIO_PCI_CAP_VNDR) != PCI_CAP_ID_VNDR) {
+			pos = next;
+			continue;
+		}
+		uint8_t cfg_type = read_io8(config, pos + VIRTIO_PCI_CAP_CFG_TYPE);
+		uint8_t bar = read_io8(config, pos + VIRTIO_PCI_CAP_BAR);
+		uint32_t offset = read_io32(config, pos + VIRTIO_PCI_CAP_OFFSET);
+		uint8_t** addr = NULL;
+		switch (cfg_type) {
+			case VIRTIO_PCI_CAP_COMMON_CFG: addr = &dev->common_cfg; break;
+			case VIRTIO_PCI_CAP_NOTIFY_CFG: addr = &dev->notify_base; break;
+			case VIRTIO_PCI_CAP_ISR_CFG: addr = &dev->isr_cfg; break;
+			case VIRTIO_PCI_CAP_DEVICE_CFG: addr = &dev->device_cfg; break;
+			// the pci configuration access capability is for drivers that can't map bars
+			default: break;
+		}
+		// a structure may be offered more than once, the first one is the preferred one - Section 4.1.4.1
+		if (addr && !*addr && bar < 6) {
+			if (!bars[bar]) {
+				bars[bar] = pci_map_bar(pci_addr, bar);
+			}
+			*addr = bars[bar] + offset;
+			debug("virtio cfg type %u at bar %u offset 0x%x", cfg_type, bar, offset);
+			if (cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG) {
+				dev->notify_off_multiplier = read_io32(config, pos + VIRTIO_PCI_NOTIFY_CAP_MULT);
+			}
+		}
+		pos = next;
+	}
+	check_err(close(config), "close");
+	if (!dev->common_cfg || !dev->notify_base) {
+		error("Device is missing the common or notify configuration");
+	}
+}
+
+static void virtio_modern_init(struct virtio_device* dev) {
+	// Section 3.1.1, unlike legacy devices the status bits accumulate
+	set_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS, VIRTIO_CONFIG_STATUS_RESET);
+	while (get_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS) != VIRTIO_CONFIG_STATUS_RESET) {
+		usleep(100);
+	}
+	uint8_t status = VIRTIO_CONFIG_STATUS_ACK;
+	set_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS, status);
+	status |= VIRTIO_CONFIG_STATUS_DRIVER;
+	set_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS, status);
+	// Negotiate features, there are 64 of them, accessed as two 32 bit words - Section 4.1.4.3
+	set_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_DFSELECT, 0);
+	uint64_t host_features = get_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_DF);
+	set_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_DFSELECT, 1);
+	host_features |= (uint64_t) get_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_DF) << 32;
+	debug("Host features: %lx", host_features);
+	// VIRTIO_F_ANY_LAYOUT is implied by VIRTIO_F_VERSION_1
+	const uint64_t required_features = (1ull << VIRTIO_NET_F_CSUM) | (1ull << VIRTIO_NET_F_GUEST_CSUM) |
+					   (1ull << VIRTIO_NET_F_CTRL_VQ) | (1ull << VIRTIO_NET_F_CTRL_RX) |
+					   (1ull << VIRTIO_F_VERSION_1);
+	if ((host_features & required_features) != required_features) {
+		error("Device does not support required features");
+	}
+	uint64_t guest_features = required_features;
+	// the net header always includes num_buffers with VIRTIO_F_VERSION_1 - Section 5.1.6
+	dev->net_hdr_len = sizeof(struct virtio_legacy_net_hdr_mrg_rxbuf);
+	if (host_features & (1ull << VIRTIO_NET_F_MRG_RXBUF)) {
+		guest_features |= 1ull << VIRTIO_NET_F_MRG_RXBUF;
+		dev->mrg_rxbuf = true;
+	}
+	if (host_features & (1ull << VIRTIO_RING_F_EVENT_IDX)) {
+		guest_features |= 1ull << VIRTIO_RING_F_EVENT_IDX;
+		dev->event_idx = true;
+	}
+	set_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_GFSELECT, 0);
+	set_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_GF, (uint32_t) guest_features);
+	set_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_GFSELECT, 1);
+	set_reg32(dev->common_cfg, VIRTIO_PCI_COMMON_GF, (uint32_t) (guest_features >> 32));
+	debug("Guest features: %lx", guest_features);
+	status |= VIRTIO_CONFIG_STATUS_FEATURES_OK;
+	set_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS, status);
+	if (!(get_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS) & VIRTIO_CONFIG_STATUS_FEATURES_OK)) {
+		error("Device did not accept our features");
+	}
+	// Queue setup - Section 5.1.2 for queue index calculation, the ctrl queue is 2 without VIRTIO_NET_F_MQ
+	debug("Device has %u queues", get_reg16(dev->common_cfg, VIRTIO_PCI_COMMON_NUMQ));
+	virtio_setup_rx_queue(dev, 0); // Rx
+	virtio_setup_tx_queue(dev, 1); // Tx
+	virtio_setup_tx_queue(dev, 2); // Control
+	_mm_mfence();
+	// Signal OK
+	status |= VIRTIO_CONFIG_STATUS_DRIVER_OK;
+	set_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS, status);
+	info("Setup complete");
+	if (get_reg8(dev->common_cfg, VIRTIO_PCI_COMMON_STATUS) & VIRTIO_CONFIG_STATUS_FAILED) {
+		error("Device signaled unrecoverable error");
+	}
+	virtio_set_promiscuous(dev, true);
 }
 
 // read stat counters and accumulate in stats
@@ -319,8 +565,9 @@ void virtio_read_stats(struct ixy_device* ixy, struct device_stats* stats) {
 		stats->tx_pkts += dev->tx_pkts;
 		stats->rx_bytes += dev->rx_bytes;
 		stats->tx_bytes += dev->tx_bytes;
+		stats->rx_refill_deferred += dev->rx_refill_deferred;
 	}
-	dev->rx_pkts = dev->tx_pkts = dev->rx_bytes = dev->tx_bytes = 0;
+	dev->rx_pkts = dev->tx_pkts = dev->rx_bytes = dev->tx_bytes = dev->rx_refill_deferred = 0;
 }
 
 
@@ -341,6 +588,7 @@ struct ixy_device* virtio_init(const char* pci_addr, uint16_t rx_queues, uint16_
 	dev->ixy.driver_name = driver_name;
 	dev->ixy.num_rx_queues = rx_queues;
 	dev->ixy.num_tx_queues = tx_queues;
+	dev->ixy.numa_node = pci_get_numa_node(pci_addr);
 	dev->ixy.rx_batch = virtio_rx_batch;
 	dev->ixy.tx_batch = virtio_tx_batch;
 	dev->ixy.read_stats = virtio_read_stats;
@@ -350,17 +598,40 @@ struct ixy_device* virtio_init(const char* pci_addr, uint16_t rx_queues, uint16_
 	int config = pci_open_resource(pci_addr, "config");
 	uint16_t device_id = read_io16(config, 2);
 	close(config);
-	// Check config if device is legacy network card
+	// Section 4.1.2.1: 0x1000 is the transitional (legacy) network card, 0x1041 the modern (virtio 1.0 only) one
+	// transitional devices might offer the modern interface as well, we keep using legacy i/o for them
 	if (device_id == 0x1000) {
 		info("Detected virtio legacy network card");
 		dev->fd = pci_open_resource(pci_addr, "resource0");
+		// the queue notification for each batch is a register write, a syscall per write is expensive
+		dev->io_port = pci_enable_ioports(pci_addr, 0);
 		virtio_legacy_init(dev);
+	} else if (device_id == 0x1041) {
+		info("Detected virtio modern network card");
+		dev->modern = true;
+		virtio_modern_map_caps(dev, pci_addr);
+		virtio_modern_init(dev);
 	} else {
-		error("Modern device not supported");
+		error("Device 0x%04x is not a virtio network card", device_id);
 	}
 	return &dev->ixy;
 }
 
+// drops the references to the bufs of a used descriptor chain and marks the descriptors as free
+static void virtio_free_desc_chain(struct virtqueue* vq, uint16_t idx) {
+	while (true) {
+		struct vring_desc* desc = &vq->vring.desc[idx];
+		pkt_buf_free_seg(vq->virtual_addresses[idx]);
+		bool has_next = desc->flags & VRING_DESC_F_NEXT;
+		uint16_t next = desc->next;
+		virtq_put_desc(vq, idx);
+		if (!has_next) {
+			break;
+		}
+		idx = next;
+	}
+}
+
 uint32_t virtio_rx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_buf* bufs[], uint32_t num_bufs) {
 	struct virtio_device* dev = IXY_TO_VIRTIO(ixy);
 	struct virtqueue* vq = dev->rx_queue;
@@ -373,54 +644,84 @@ uint32_t virtio_rx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_b
 		if (vq->vq_used_last_idx == vq->vring.used->idx) {
 			break;
 		}
-		// info("Rx packet: last used %u, used idx %u", vq->vq_used_last_idx,
-		// vq->vring.used->idx);
 		struct vring_used_elem* e = vq->vring.used->ring + (vq->vq_used_last_idx % vq->vring.num);
-		// info("Used elem %p, id %u len %u", e, e->id, e->len);
-		struct vring_desc* desc = &vq->vring.desc[e->id];
-		vq->vq_used_last_idx++;
-		// We don't support chaining or indirect descriptors
-		if (desc->flags != VRING_DESC_F_WRITE) {
-			error("unsupported rx flags on descriptor: %x", desc->flags);
+		struct pkt_buf* head = vq->virtual_addresses[e->id];
+		// Section 5.1.6.4: with mergeable rx buffers, a packet can be spread over several used descriptors
+		// the device only publishes the packet once all of them are written, check anyways
+		uint16_t num_buffers = 1;
+		if (dev->mrg_rxbuf) {
+			num_buffers = ((struct virtio_legacy_net_hdr_mrg_rxbuf*) net_hdr_virt(dev, head))->num_buffers;
 		}
-		// info("Desc %lu %u %u %u", desc->addr, desc->len, desc->flags,
-		// desc->next);
-		*desc = (struct vring_desc){};
-
-		// Section 5.1.6.4
-		struct pkt_buf* buf = vq->virtual_addresses[e->id];
-		buf->size = e->len;
-		bufs[buf_idx] = buf;
-		//struct virtio_net_hdr* hdr = (void*)(buf->head_room + sizeof(buf->head_room) - sizeof(net_hdr));
+		if ((uint16_t) (vq->vring.used->idx - vq->vq_used_last_idx) < num_buffers) {
+			break;
+		}
+		struct pkt_buf* tail = head;
+		for (uint16_t i = 0; i < num_buffers; i++) {
+			e = vq->vring.used->ring + (vq->vq_used_last_idx % vq->vring.num);
+			struct vring_desc* desc = &vq->vring.desc[e->id];
+			vq->vq_used_last_idx++;
+			// We don't support chaining or indirect descriptors
+			if (desc->flags != VRING_DESC_F_WRITE) {
+				error("unsupported rx flags on descriptor: %x", desc->flags);
+			}
+			virtq_put_desc(vq, e->id);
+			struct pkt_buf* buf = vq->virtual_addresses[e->id];
+			buf->flags |= PKT_BUF_DIRTY;
+			if (i == 0) {
+				// the used length includes the net header
+				buf->size = e->len - dev->net_hdr_len;
+				buf->pkt_len = buf->size;
+			} else {
+				// only the first buffer starts with a net header, the data of the others starts right at the
+				// descriptor address in front of buf->data, move it to where it's expected (rare: jumbo frames only)
+				buf->size = e->len;
+				memmove(buf->data, net_hdr_virt(dev, buf), buf->size);
+				pkt_buf_append_seg(head, tail, buf);
+				tail = buf;
+			}
+		}
+		// no offloads negotiated, the net header doesn't tell us anything
+		// rss_hash and timestamp share the head room with the net header and stay invalid
+		head->meta.port = dev->ixy.port_id;
+		head->meta.queue = queue_id;
+		head->meta.ol_flags = 0;
+		head->meta.packet_type = 0;
+		bufs[buf_idx] = head;
 
 		// Update rx counter
-		dev->rx_bytes += buf->size;
+		dev->rx_bytes += head->pkt_len;
 		dev->rx_pkts++;
 	}
-	// Fill empty slots in desciptor table
-	for (uint16_t idx = 0; idx < vq->vring.num; ++idx) {
-		struct vring_desc* desc = &vq->vring.desc[idx];
-		if (desc->addr != 0) { // descriptor points to something, therefore it is in use
-			continue;
+	virtio_suppress_interrupts(vq);
+	// Fill empty slots in desciptor table, they are all published to the device with a single index update
+	uint16_t avail_idx = vq->vring.avail->idx;
+	struct pkt_buf* new_bufs[RX_REFILL_BATCH];
+	while (vq->num_free) {
+		uint32_t batch = vq->num_free < RX_REFILL_BATCH ? vq->num_free : RX_REFILL_BATCH;
+		uint32_t num_allocated = pkt_buf_alloc_batch(vq->mempool, new_bufs, batch);
+		for (uint32_t i = 0; i < num_allocated; i++) {
+			uint16_t idx = virtq_get_desc(vq);
+			// the descriptor starts at the net header in front of buf->data but must not be longer than the data area:
+			// merged rx buffers after the first one have no net header and their contents are moved to buf->data
+			vq->vring.desc[idx].len = vq->mempool->buf_size - offsetof(struct pkt_buf, data);
+			vq->vring.desc[idx].addr = net_hdr_phy(dev, new_bufs[i]);
+			vq->vring.desc[idx].flags = VRING_DESC_F_WRITE;
+			vq->vring.desc[idx].next = 0;
+			vq->virtual_addresses[idx] = new_bufs[i];
+			vq->vring.avail->ring[avail_idx++ % vq->vring.num] = idx;
 		}
-		// info("Found free desc slot at %u (%u)", idx, vq->vring.num);
-		struct pkt_buf* buf = pkt_buf_alloc(vq->mempool);
-		if (!buf) {
-			error("failed to allocate new mbuf for rx, you are either leaking memory or your mempool is too small");
+		if (num_allocated < batch) {
+			// mempool is empty, keep the remaining descriptors free and try again in the next call
+			dev->rx_refill_deferred++;
+			break;
 		}
-		buf->size = vq->mempool->buf_size;
-		memcpy(buf->head_room + sizeof(buf->head_room) - sizeof(net_hdr), &net_hdr, sizeof(net_hdr));
-		vq->vring.desc[idx].len = buf->size + sizeof(net_hdr);
-		vq->vring.desc[idx].addr =
-		    buf->buf_addr_phy + offsetof(struct pkt_buf, head_room) + sizeof(buf->head_room) - sizeof(net_hdr);
-		vq->vring.desc[idx].flags = VRING_DESC_F_WRITE;
-		vq->vring.desc[idx].next = 0;
-		vq->virtual_addresses[idx] = buf;
-		vq->vring.avail->ring[vq->vring.avail->idx % vq->vring.num] = idx;
-		_mm_mfence(); // Make sure exposed descriptors reach device before index is updated
-		vq->vring.avail->idx++;
-		_mm_mfence(); // Make sure the index update reaches device before it is triggered
-		virtio_legacy_notify_queue(dev, 0);
+	}
+	if (avail_idx != vq->vring.avail->idx) {
+		uint16_t old_avail_idx = vq->vring.avail->idx;
+		// x86 doesn't reorder stores, so a compiler barrier is enough to expose the descriptors before the index
+		__asm__ volatile ("" : : : "memory");
+		vq->vring.avail->idx = avail_idx;
+		virtio_kick(dev, vq, 0, old_avail_idx);
 	}
 	return buf_idx;
 }
@@ -432,54 +733,60 @@ uint32_t virtio_tx_batch(struct ixy_device* ixy, uint16_t queue_id, struct pkt_b
 	_mm_mfence();
 	// Free sent buffers
 	while (vq->vq_used_last_idx != vq->vring.used->idx) {
-		// info("We can free some buffers: %u != %u", vq->vq_used_last_idx,
-		// vq->vring.used->idx);
 		struct vring_used_elem* e = vq->vring.used->ring + (vq->vq_used_last_idx % vq->vring.num);
-		// info("e %p, id %u", e, e->id);
-		struct vring_desc* desc = &vq->vring.desc[e->id];
-		desc->addr = 0;
-		desc->len = 0;
-		pkt_buf_free(vq->virtual_addresses[e->id]);
+		virtio_free_desc_chain(vq, e->id);
 		vq->vq_used_last_idx++;
 		_mm_mfence();
 	}
+	virtio_suppress_interrupts(vq);
 	// Send buffers
 	uint32_t buf_idx;
-	uint16_t idx = 0; // Keep index of last found free descriptor and start searching from there
 	for (buf_idx = 0; buf_idx < num_bufs; ++buf_idx) {
 		struct pkt_buf* buf = bufs[buf_idx];
-		// Find free desc index
-		for (; idx < vq->vring.num; ++idx) {
-			struct vring_desc* desc = &vq->vring.desc[idx];
-			if (desc->addr == 0) {
-				break;
-			}
+		// Each segment gets its own descriptor, the net header goes in front of the first one
+		uint16_t num_segs = 0;
+		uint32_t pkt_len = 0;
+		for (struct pkt_buf* seg = buf; seg; seg = seg->next) {
+			num_segs++;
+			pkt_len += seg->size;
 		}
-		if (idx == vq->vring.num) {
+		if (num_segs > vq->num_free) {
 			break;
 		}
-		// info("Found free desc slot at %u (%u)", idx, vq->vring.num);
+		uint16_t head = 0;
+		struct vring_desc* prev = NULL;
+		for (struct pkt_buf* seg = buf; seg; seg = seg->next) {
+			uint16_t idx = virtq_get_desc(vq);
+			vq->virtual_addresses[idx] = seg;
+			struct vring_desc* desc = &vq->vring.desc[idx];
+			if (seg == buf) {
+				// Copy header to headroom in front of data buffer
+				memcpy(net_hdr_virt(dev, seg), &net_hdr, dev->net_hdr_len);
+				desc->len = seg->size + dev->net_hdr_len;
+				desc->addr = net_hdr_phy(dev, seg);
+				head = idx;
+			} else {
+				desc->len = seg->size;
+				desc->addr = seg->buf_addr_phy + offsetof(struct pkt_buf, data);
+				prev->flags = VRING_DESC_F_NEXT;
+				prev->next = idx;
+			}
+			desc->flags = 0;
+			desc->next = 0;
+			prev = desc;
+		}
 
 		// Update tx counter
-		dev->tx_bytes += buf->size;
+		dev->tx_bytes += pkt_len;
 		dev->tx_pkts++;
 
-		vq->virtual_addresses[idx] = buf;
-
-		// Copy header to headroom in front of data buffer
-		memcpy(buf->head_room + sizeof(buf->head_room) - sizeof(net_hdr), &net_hdr, sizeof(net_hdr));
-
-		vq->vring.desc[idx].len = buf->size + sizeof(net_hdr);
-		vq->vring.desc[idx].addr =
-		    buf->buf_addr_phy + offsetof(struct pkt_buf, head_room) + sizeof(buf->head_room) - sizeof(net_hdr);
-		vq->vring.desc[idx].flags = 0;
-		vq->vring.desc[idx].next = 0;
-		vq->vring.avail->ring[idx] = idx;
+		vq->vring.avail->ring[(vq->vring.avail->idx + buf_idx) % vq->vring.num] = head;
+	}
+	if (buf_idx) {
+		uint16_t old_avail_idx = vq->vring.avail->idx;
+		_mm_mfence();
+		vq->vring.avail->idx += buf_idx;
+		virtio_kick(dev, vq, 1, old_avail_idx);
 	}
-	_mm_mfence();
-	vq->vring.avail->idx += buf_idx;
-	_mm_mfence();
-	virtio_legacy_notify_queue(dev, 1);
 	return buf_idx;
 }
-
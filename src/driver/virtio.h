@@ -8,13 +8,30 @@
 struct virtio_device {
 	struct ixy_device ixy;
 	int fd;
+	// base of the legacy io bar if we can use direct port i/o, 0 to use pread/pwrite on fd instead
+	uint16_t io_port;
+	// virtio 1.0 device: the registers are in memory bars at the locations given by its pci capabilities
+	bool modern;
+	uint8_t* common_cfg;
+	// the doorbell of a queue is at notify_base + queue_notify_off * notify_off_multiplier
+	uint8_t* notify_base;
+	uint32_t notify_off_multiplier;
+	uint8_t* isr_cfg; // unused, we poll
+	uint8_t* device_cfg;
 	void* rx_queue;
 	void* tx_queue;
 	void* ctrl_queue;
+	// size of the virtio net header in front of each packet, depends on the negotiated features
+	uint16_t net_hdr_len;
+	// VIRTIO_NET_F_MRG_RXBUF was negotiated: a received packet can span several descriptors
+	bool mrg_rxbuf;
+	// VIRTIO_RING_F_EVENT_IDX was negotiated: notifications are controlled by the event indices instead of flags
+	bool event_idx;
 	uint64_t rx_pkts;
 	uint64_t tx_pkts;
 	uint64_t rx_bytes;
 	uint64_t tx_bytes;
+	uint64_t rx_refill_deferred;
 };
 
 #define IXY_TO_VIRTIO(ixy_device) container_of(ixy_device, struct virtio_device, ixy)
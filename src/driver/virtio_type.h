@@ -58,6 +58,52 @@
 #define VIRTIO_MSI_CONFIG_VECTOR 20 /* configuration change vector (16, RW) */
 #define VIRTIO_MSI_QUEUE_VECTOR 22  /* vector for selected VQ notifications (16, RW) */
 
+/*
+ * VirtIO 1.0 PCI capabilities, located in the PCI config space - Section 4.1.4.
+ */
+#define PCI_STATUS 0x06           /* PCI status register (16) */
+#define PCI_STATUS_CAP_LIST 0x10  /* capability list present */
+#define PCI_CAPABILITY_LIST 0x34  /* offset of the first capability (8) */
+#define PCI_CAP_ID_VNDR 0x09      /* vendor-specific capability */
+/* Fields of struct virtio_pci_cap */
+#define VIRTIO_PCI_CAP_VNDR 0        /* generic PCI field: PCI_CAP_ID_VNDR (8) */
+#define VIRTIO_PCI_CAP_NEXT 1        /* generic PCI field: next ptr (8) */
+#define VIRTIO_PCI_CAP_LEN 2         /* generic PCI field: capability length (8) */
+#define VIRTIO_PCI_CAP_CFG_TYPE 3    /* identifies the structure (8) */
+#define VIRTIO_PCI_CAP_BAR 4         /* where to find it (8) */
+#define VIRTIO_PCI_CAP_OFFSET 8      /* offset within bar (32) */
+#define VIRTIO_PCI_CAP_LENGTH 12     /* length of the structure, in bytes (32) */
+#define VIRTIO_PCI_NOTIFY_CAP_MULT 16 /* multiplier for queue_notify_off (32), notify capability only */
+/* Values of cfg_type */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1 /* common configuration */
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2 /* notifications */
+#define VIRTIO_PCI_CAP_ISR_CFG 3    /* ISR status */
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4 /* device specific configuration */
+#define VIRTIO_PCI_CAP_PCI_CFG 5    /* PCI configuration access */
+
+/*
+ * Fields of struct virtio_pci_common_cfg, located in the bar given by the common configuration capability.
+ */
+#define VIRTIO_PCI_COMMON_DFSELECT 0      /* device feature select (32, RW) */
+#define VIRTIO_PCI_COMMON_DF 4            /* device features, 32 bits selected by DFSELECT (32, RO) */
+#define VIRTIO_PCI_COMMON_GFSELECT 8      /* driver feature select (32, RW) */
+#define VIRTIO_PCI_COMMON_GF 12           /* driver features, 32 bits selected by GFSELECT (32, RW) */
+#define VIRTIO_PCI_COMMON_MSIX 16         /* configuration change vector (16, RW) */
+#define VIRTIO_PCI_COMMON_NUMQ 18         /* number of queues (16, RO) */
+#define VIRTIO_PCI_COMMON_STATUS 20       /* device status (8, RW) */
+#define VIRTIO_PCI_COMMON_CFGGENERATION 21 /* configuration atomicity value (8, RO) */
+#define VIRTIO_PCI_COMMON_Q_SELECT 22     /* queue select (16, RW) */
+#define VIRTIO_PCI_COMMON_Q_SIZE 24       /* queue size, max size on reset (16, RW) */
+#define VIRTIO_PCI_COMMON_Q_MSIX 26       /* queue vector (16, RW) */
+#define VIRTIO_PCI_COMMON_Q_ENABLE 28     /* queue enable (16, RW) */
+#define VIRTIO_PCI_COMMON_Q_NOFF 30       /* queue notify offset (16, RO) */
+#define VIRTIO_PCI_COMMON_Q_DESCLO 32     /* descriptor table address (64, RW) */
+#define VIRTIO_PCI_COMMON_Q_DESCHI 36
+#define VIRTIO_PCI_COMMON_Q_AVAILLO 40    /* available ring address (64, RW) */
+#define VIRTIO_PCI_COMMON_Q_AVAILHI 44
+#define VIRTIO_PCI_COMMON_Q_USEDLO 48     /* used ring address (64, RW) */
+#define VIRTIO_PCI_COMMON_Q_USEDHI 52
+
 /* Status byte for guest to report progress. */
 #define VIRTIO_CONFIG_STATUS_RESET 0x00
 #define VIRTIO_CONFIG_STATUS_ACK 0x01
@@ -72,6 +118,9 @@
  */
 #define VIRTIO_PCI_QUEUE_ADDR_SHIFT 12
 
+/* The alignment to use between consumer and producer parts of vring. */
+#define VIRTIO_PCI_VRING_ALIGN 4096
+
 /* This marks a buffer as continuing via the next field. */
 #define VRING_DESC_F_NEXT 1
 /* This marks a buffer as write-only (otherwise read-only). */
@@ -111,6 +160,12 @@
 /* We support indirect buffer descriptors */
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 
+/* The Guest publishes the used index for which it expects an interrupt
+ * at the end of the avail ring. Host should ignore the avail->flags field. */
+/* The Host publishes the avail index for which it expects a kick
+ * at the end of the used ring. Guest should ignore the used->flags field. */
+#define VIRTIO_RING_F_EVENT_IDX 29
+
 #define VIRTIO_F_VERSION_1 32
 #define VIRTIO_F_IOMMU_PLATFORM 33
 
@@ -167,6 +222,15 @@ struct virtio_legacy_net_hdr {
 	uint16_t csum_offset; /**< Offset after that to place checksum */
 };
 
+/**
+ * This is the version of the header to use when the MRG_RXBUF
+ * feature has been negotiated.
+ */
+struct virtio_legacy_net_hdr_mrg_rxbuf {
+	struct virtio_legacy_net_hdr hdr;
+	uint16_t num_buffers; /**< Number of merged rx buffers */
+};
+
 /* This marks a buffer as continuing via the next field. */
 #define VRING_DESC_F_NEXT 1
 /* This marks a buffer as write-only (otherwise read-only). */
@@ -250,6 +314,9 @@ struct virtqueue {
 	// Additional information for the driver only
 	uint64_t notification_offset;
 	uint16_t vq_used_last_idx;
+	// Descriptors not owned by the device form a list linked via their next field, see virtq_get_desc
+	uint16_t free_head;
+	uint16_t num_free;
 	struct mempool* mempool; // Unused in Tx queues
 	// virtual addresses to map descriptors back to their mbuf for freeing
 	void* virtual_addresses[];
@@ -260,7 +327,7 @@ struct virtqueue {
  * versa. They are at the end for backwards compatibility.
  */
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr) (*(uint16_t*)&(vr)->used->ring[(vr)->num])
+#define vring_avail_event(vr) (*(volatile uint16_t*)((uint8_t*)(vr)->used->ring + (vr)->num * sizeof(struct vring_used_elem)))
 
 /*
  * The following is used with VIRTIO_RING_F_EVENT_IDX.
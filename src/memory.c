@@ -1,22 +1,39 @@
 #include "memory.h"
 #include "log.h"
 
+#include <emmintrin.h>
 #include <stddef.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/memfd.h>
+
+// the pagemap fd is opened once and kept open, pread on it is thread-safe
+static int pagemap_fd = -1;
+
+static int get_pagemap_fd() {
+	if (pagemap_fd < 0) {
+		int fd = check_err(open("/proc/self/pagemap", O_RDONLY), "getting pagemap");
+		if (!__sync_bool_compare_and_swap(&pagemap_fd, -1, fd)) {
+			// another thread was faster
+			close(fd);
+		}
+	}
+	return pagemap_fd;
+}
 
 // translate a virtual address to a physical one via /proc/self/pagemap
 static uintptr_t virt_to_phys(void* virt) {
 	long pagesize = sysconf(_SC_PAGESIZE);
-	int fd = check_err(open("/proc/self/pagemap", O_RDONLY), "getting pagemap");
 	// pagemap is an array of pointers for each normal-sized page
-	check_err(lseek(fd, (uintptr_t) virt / pagesize * sizeof(uintptr_t), SEEK_SET), "getting pagemap");
 	uintptr_t phy = 0;
-	check_err(read(fd, &phy, sizeof(phy)), "translating address");
-	close(fd);
+	check_err(pread(get_pagemap_fd(), &phy, sizeof(phy), (uintptr_t) virt / pagesize * sizeof(uintptr_t)), "translating address");
 	if (!phy) {
 		error("failed to translate virtual address %p to physical address", virt);
 	}
@@ -24,82 +41,917 @@ static uintptr_t virt_to_phys(void* virt) {
 	return (phy & 0x7fffffffffffffULL) * pagesize + ((uintptr_t) virt) % pagesize;
 }
 
+// translate a whole region backed by huge pages with one lookup per huge page
+// phys[i] receives the physical address of the i-th huge page touched by the region (starting at the page containing virt)
+// returns the virtual address of the first huge page, i.e., the base for indexing phys
+static uintptr_t virt_to_phys_region(void* virt, size_t size, uintptr_t phys[]) {
+	uintptr_t first_page = ((uintptr_t) virt) & ~((uintptr_t) HUGE_PAGE_SIZE - 1);
+	uintptr_t end = (uintptr_t) virt + size;
+	for (uint32_t i = 0; first_page + ((uintptr_t) i << HUGE_PAGE_BITS) < end; i++) {
+		phys[i] = virt_to_phys((void*) (first_page + ((uintptr_t) i << HUGE_PAGE_BITS)));
+	}
+	return first_page;
+}
+
+#define HUGE_MOUNT "/mnt/huge"
+#define HUGE_MOUNT_1G "/mnt/huge-1G"
+#define HUGE_PAGE_1G_SIZE (1ull << 30)
+
 static uint32_t huge_pg_id;
+static uint32_t huge_pages_in_use;
 
-// allocate memory suitable for DMA access in huge pages
-// this requires hugetlbfs to be mounted at /mnt/huge
-// not using anonymous hugepages because hugetlbfs can give us multiple pages with contiguous virtual addresses
-// allocating anonymous pages would require manual remapping which is more annoying than handling files
-struct dma_memory memory_allocate_dma(size_t size, bool require_contiguous) {
-	// round up to multiples of 2 MB if necessary, this is the wasteful part
-	// this could be fixed by co-locating allocations on the same page until a request would be too large
-	// when fixing this: make sure to align on 128 byte boundaries (82599 dma requirement)
-	if (size % HUGE_PAGE_SIZE) {
-		size = ((size >> HUGE_PAGE_BITS) + 1) << HUGE_PAGE_BITS;
+// threads are numbered on their first mempool access, the id selects the cache in every mempool
+// ids are released when the thread exits, the next new thread takes over the caches including the bufs in them
+// threads that find all MEMPOOL_MAX_THREADS ids in use fall back to using the ring directly
+static volatile uint64_t thread_ids_in_use;
+static __thread int32_t thread_id = -1;
+// only used for its destructor which releases the id of an exiting thread
+static pthread_key_t thread_id_key;
+static pthread_once_t thread_id_key_once = PTHREAD_ONCE_INIT;
+
+static_assert(MEMPOOL_MAX_THREADS <= 64, "thread ids must fit into the thread_ids_in_use bitmap");
+
+// shared memory mode: a primary process owns the devices and shares all DMA memory with secondary processes
+// DMA memory comes from named hugetlbfs files mapped at fixed addresses, a registry in /dev/shm lists the files
+// secondaries map them at the same virtual addresses, so all pointers into DMA memory stay valid in all processes
+// everything that needs to be shared (mempools, driver queue state) is therefore allocated from DMA memory
+#define SHARED_REGISTRY_DIR "/dev/shm"
+#define SHARED_REGISTRY_MAGIC 0x53797869 // "ixyS"
+// far away from where the kernel places mappings by default, so the range is very likely free in all processes
+#define SHARED_BASE_ADDR 0x100000000000ull
+#define MAX_SHARED_MAPPINGS 1024
+#define MAX_SHARED_OBJECTS 64
+#define MAX_SHARED_NAME 64
+
+#ifndef MAP_FIXED_NOREPLACE
+// Linux 4.17+, older kernels ignore it and treat the address as a hint
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+struct shared_registry {
+	uint32_t magic;
+	// thread ids must be unique over all processes, they select the per-thread caches in the mempools
+	volatile uint64_t thread_ids_in_use;
+	uintptr_t next_addr;
+	// only appended to by the primary, published by incrementing the counts
+	volatile uint32_t num_mappings;
+	volatile uint32_t num_objects;
+	struct {
+		uintptr_t virt;
+		size_t size;
+		char path[128];
+	} mappings[MAX_SHARED_MAPPINGS];
+	// named pointers into shared memory, e.g., devices by their pci address
+	struct {
+		char name[MAX_SHARED_NAME];
+		void* ptr;
+	} objects[MAX_SHARED_OBJECTS];
+};
+
+enum shared_mode {
+	SHARED_NONE,
+	SHARED_PRIMARY,
+	SHARED_SECONDARY,
+};
+
+static enum shared_mode shared_mode;
+static struct shared_registry* shared_registry;
+static char shared_name[MAX_SHARED_NAME];
+static volatile uint32_t shared_registry_lock;
+
+// restrict the pages backing a mapping to a NUMA node, must be called before the pages are faulted in
+// no libnuma dependency: the mbind syscall is simple enough to use directly
+static void bind_to_node(void* virt, size_t size, int node) {
+	if (node == NUMA_NODE_ANY) {
+		return;
 	}
-	if (require_contiguous && size > HUGE_PAGE_SIZE) {
-		// this is the place to implement larger contiguous physical mappings if that's ever needed
-		error("could not map physically contiguous memory");
+	if (node < 0 || node >= MAX_NUMA_NODES) {
+		error("invalid NUMA node %d", node);
 	}
-	// unique filename, C11 stdatomic.h requires a too recent gcc, we want to support gcc 4.8
-	uint32_t id = __sync_fetch_and_add(&huge_pg_id, 1);
-	char path[PATH_MAX];
-	snprintf(path, PATH_MAX, "/mnt/huge/ixy-%d-%d", getpid(), id);
-	// temporary file, will be deleted to prevent leaks of persistent pages
-	int fd = check_err(open(path, O_CREAT | O_RDWR, S_IRWXU), "open hugetlbfs file, check that /mnt/huge is mounted");
-	check_err(ftruncate(fd, (off_t) size), "allocate huge page memory, check hugetlbfs configuration");
-	void* virt_addr = (void*) check_err(mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB, fd, 0), "mmap hugepage");
+	unsigned long nodemask = 1ul << node;
+	// maxnode is the number of bits in the mask + 1 for historic reasons
+	if (syscall(SYS_mbind, virt, size, MPOL_BIND, &nodemask, sizeof(nodemask) * 8 + 1, 0)) {
+		// kernels without NUMA support end up here, that's fine: there is only one node anyways
+		warn("could not bind DMA memory to NUMA node %d: %s", node, strerror(errno));
+	}
+}
+
+// DMA memory can come from different backends, the first one that works is used unless IXY_DMA_BACKEND is set:
+// * memfd: memfd_create with MFD_HUGETLB (Linux 4.14+), no filesystem needed but we still get an fd for remapping
+// * hugetlbfs: temporary files on a hugetlbfs mount at /mnt/huge
+// * anonymous: mmap with MAP_HUGETLB, works everywhere but pages can't be remapped to build contiguous runs
+enum dma_backend {
+	DMA_BACKEND_UNKNOWN,
+	DMA_BACKEND_MEMFD,
+	DMA_BACKEND_HUGETLBFS,
+	DMA_BACKEND_ANONYMOUS,
+};
+
+static const char* dma_backend_names[] = {
+	[DMA_BACKEND_MEMFD] = "memfd",
+	[DMA_BACKEND_HUGETLBFS] = "hugetlbfs",
+	[DMA_BACKEND_ANONYMOUS] = "anonymous",
+};
+
+static enum dma_backend dma_backend;
+
+static enum dma_backend get_dma_backend() {
+	if (dma_backend != DMA_BACKEND_UNKNOWN) {
+		return dma_backend;
+	}
+	// racing threads end up with the same result, so no synchronization necessary
+	enum dma_backend backend = DMA_BACKEND_UNKNOWN;
+	const char* requested = getenv("IXY_DMA_BACKEND");
+	if (requested) {
+		for (int i = DMA_BACKEND_MEMFD; i <= DMA_BACKEND_ANONYMOUS; i++) {
+			if (!strcmp(requested, dma_backend_names[i])) {
+				backend = (enum dma_backend) i;
+			}
+		}
+		if (backend == DMA_BACKEND_UNKNOWN) {
+			error("unknown DMA memory backend %s, use memfd, hugetlbfs, or anonymous", requested);
+		}
+	} else {
+		// glibc only has a wrapper for memfd_create since 2.27
+		int fd = (int) syscall(SYS_memfd_create, "ixy-probe", MFD_HUGETLB);
+		if (fd != -1) {
+			close(fd);
+			backend = DMA_BACKEND_MEMFD;
+		} else if (access(HUGE_MOUNT, W_OK) == 0) {
+			backend = DMA_BACKEND_HUGETLBFS;
+		} else {
+			backend = DMA_BACKEND_ANONYMOUS;
+		}
+	}
+	info("using %s huge pages for DMA memory", dma_backend_names[backend]);
+	dma_backend = backend;
+	return backend;
+}
+
+// create a temporary file backed by huge pages, returns -1 and sets errno on failure
+static int create_huge_file(size_t size, bool page_1g) {
+	int fd;
+	if (get_dma_backend() == DMA_BACKEND_MEMFD) {
+		fd = (int) syscall(SYS_memfd_create, "ixy-dma", MFD_HUGETLB | (page_1g ? MFD_HUGE_1GB : MFD_HUGE_2MB));
+		if (fd == -1) {
+			return -1;
+		}
+	} else {
+		// unique filename, C11 stdatomic.h requires a too recent gcc, we want to support gcc 4.8
+		uint32_t id = __sync_fetch_and_add(&huge_pg_id, 1);
+		char path[PATH_MAX];
+		snprintf(path, PATH_MAX, "%s/ixy-%d-%d", page_1g ? HUGE_MOUNT_1G : HUGE_MOUNT, getpid(), id);
+		fd = open(path, O_CREAT | O_RDWR, S_IRWXU);
+		if (fd == -1) {
+			return -1;
+		}
+		// don't keep it around in the hugetlbfs to prevent leaks of persistent pages, the fd keeps it alive
+		unlink(path);
+	}
+	if (ftruncate(fd, (off_t) size)) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// map huge pages and fault them in on the given node, returns MAP_FAILED and sets errno on failure
+// fd is -1 for anonymous mappings, addr is only a hint unless MAP_FIXED is passed in flags
+static void* map_huge_pages(int fd, size_t size, int node, void* addr, int flags) {
+	void* virt_addr = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB | flags, fd, 0);
+	if (virt_addr == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	// pages are allocated on the first access (mlock below), so the policy must be in place before that
+	bind_to_node(virt_addr, size, node);
 	// never swap out DMA memory
-	check_err(mlock(virt_addr, size), "disable swap for DMA memory");
-	// don't keep it around in the hugetlbfs
-	close(fd);
-	unlink(path);
+	if (mlock(virt_addr, size)) {
+		int err = errno;
+		munmap(virt_addr, size);
+		errno = err;
+		return MAP_FAILED;
+	}
+	return virt_addr;
+}
+
+// shared memory mode: map huge pages from a named file at the next free address of the shared range
+// returns MAP_FAILED and sets errno on failure
+static void* map_new_shared_pages(size_t size, bool page_1g, int node) {
+	while (__sync_lock_test_and_set(&shared_registry_lock, 1)) {
+		_mm_pause();
+	}
+	struct shared_registry* registry = shared_registry;
+	uint32_t id = registry->num_mappings;
+	if (id == MAX_SHARED_MAPPINGS) {
+		error("too many shared memory mappings, increase MAX_SHARED_MAPPINGS");
+	}
+	char* path = registry->mappings[id].path;
+	snprintf(path, sizeof(registry->mappings[id].path), "%s/ixy-%s-%u", page_1g ? HUGE_MOUNT_1G : HUGE_MOUNT, shared_name, id);
+	void* virt_addr = MAP_FAILED;
+	int fd = open(path, O_CREAT | O_RDWR, S_IRWXU);
+	if (fd != -1) {
+		uintptr_t page_size = page_1g ? HUGE_PAGE_1G_SIZE : HUGE_PAGE_SIZE;
+		uintptr_t addr = (registry->next_addr + page_size - 1) & ~(page_size - 1);
+		if (ftruncate(fd, (off_t) size) == 0) {
+			virt_addr = map_huge_pages(fd, size, node, (void*) addr, MAP_FIXED_NOREPLACE);
+		}
+		if (virt_addr != MAP_FAILED && (uintptr_t) virt_addr != addr) {
+			munmap(virt_addr, size);
+			virt_addr = MAP_FAILED;
+			errno = EEXIST;
+		}
+		int err = errno;
+		close(fd);
+		if (virt_addr == MAP_FAILED) {
+			unlink(path);
+		} else {
+			registry->mappings[id].virt = addr;
+			registry->mappings[id].size = size;
+			registry->next_addr = addr + size;
+			__atomic_store_n(&registry->num_mappings, id + 1, __ATOMIC_RELEASE);
+		}
+		errno = err;
+	}
+	__sync_lock_release(&shared_registry_lock);
+	return virt_addr;
+}
+
+// map new huge pages from the selected backend, returns MAP_FAILED and sets errno on failure
+// fd is set to the backing file if not NULL (-1 for anonymous memory), it's the caller's job to close it
+static void* map_new_huge_pages(size_t size, bool page_1g, int node, int* fd) {
+	if (shared_mode == SHARED_PRIMARY) {
+		// the file stays around for the secondaries, there's no fd to hand out
+		if (fd) {
+			*fd = -1;
+		}
+		return map_new_shared_pages(size, page_1g, node);
+	}
+	if (get_dma_backend() == DMA_BACKEND_ANONYMOUS) {
+		if (fd) {
+			*fd = -1;
+		}
+		return map_huge_pages(-1, size, node, NULL, MAP_ANONYMOUS | ((page_1g ? 30 : HUGE_PAGE_BITS) << MAP_HUGE_SHIFT));
+	}
+	int file = create_huge_file(size, page_1g);
+	if (file == -1) {
+		return MAP_FAILED;
+	}
+	void* virt_addr = map_huge_pages(file, size, node, NULL, 0);
+	if (virt_addr == MAP_FAILED || !fd) {
+		int err = errno;
+		close(file);
+		errno = err;
+	} else {
+		*fd = file;
+	}
+	return virt_addr;
+}
+
+// allocate whole huge pages, size is rounded up to a multiple of the huge page size
+static struct dma_memory allocate_huge_pages(size_t size, int node) {
+	if (size % HUGE_PAGE_SIZE) {
+		size = ((size >> HUGE_PAGE_BITS) + 1) << HUGE_PAGE_BITS;
+	}
+	void* virt_addr = (void*) check_err(map_new_huge_pages(size, false, node, NULL), "allocate huge pages, check hugepage configuration and available pages on the NUMA node");
+	__sync_fetch_and_add(&huge_pages_in_use, size >> HUGE_PAGE_BITS);
 	return (struct dma_memory) {
 		.virt = virt_addr,
 		.phy = virt_to_phys(virt_addr)
 	};
 }
 
+struct huge_page_candidate {
+	int fd;
+	void* virt;
+	uintptr_t phy;
+};
+
+static int compare_candidates(const void* a, const void* b) {
+	uintptr_t phy_a = ((const struct huge_page_candidate*) a)->phy;
+	uintptr_t phy_b = ((const struct huge_page_candidate*) b)->phy;
+	return phy_a < phy_b ? -1 : phy_a > phy_b;
+}
+
+// returns the index of the first page of a run of num_pages physically adjacent pages in sorted candidates, or -1
+static int32_t find_contiguous_run(struct huge_page_candidate* candidates, uint32_t num_candidates, uint32_t num_pages) {
+	uint32_t run_length = 0;
+	for (uint32_t i = 0; i < num_candidates; i++) {
+		if (i > 0 && candidates[i].phy == candidates[i - 1].phy + HUGE_PAGE_SIZE) {
+			run_length++;
+		} else {
+			run_length = 1;
+		}
+		if (run_length == num_pages) {
+			return (int32_t) (i + 1 - num_pages);
+		}
+	}
+	return -1;
+}
+
+// fallback for physically contiguous memory larger than a huge page if there are no 1 GB pages
+// the kernel often hands out adjacent huge pages, especially on a freshly booted system
+// so we allocate single pages until we find a run of physically adjacent pages and map them into a contiguous virtual range
+static struct dma_memory allocate_contiguous_run(size_t size, int node) {
+	uint32_t num_pages = size >> HUGE_PAGE_BITS;
+	uint32_t max_candidates = num_pages * 8 + 32;
+	struct huge_page_candidate* candidates = (struct huge_page_candidate*) calloc(max_candidates, sizeof(*candidates));
+	uint32_t num_candidates = 0;
+	int32_t run_start = -1;
+	if (get_dma_backend() == DMA_BACKEND_ANONYMOUS) {
+		error("can't remap anonymous huge pages into %zu bytes of contiguous memory, use memfd or hugetlbfs", size);
+	}
+	if (shared_mode != SHARED_NONE) {
+		error("can't build %zu bytes of contiguous memory in shared memory mode, reserve some 1 GB pages", size);
+	}
+	while (num_candidates < max_candidates && run_start < 0) {
+		int fd;
+		void* virt = map_new_huge_pages(HUGE_PAGE_SIZE, false, node, &fd);
+		if (virt == MAP_FAILED) {
+			break;
+		}
+		candidates[num_candidates++] = (struct huge_page_candidate) {
+			.fd = fd,
+			.virt = virt,
+			.phy = virt_to_phys(virt)
+		};
+		qsort(candidates, num_candidates, sizeof(*candidates), compare_candidates);
+		run_start = find_contiguous_run(candidates, num_candidates, num_pages);
+	}
+	if (run_start < 0) {
+		error("could not find %u physically contiguous huge pages in %u pages, reserve some 1 GB pages", num_pages, num_candidates);
+	}
+	// hugetlbfs mappings must be aligned to the huge page size, so reserve a bit more address space than needed
+	uint8_t* reserved = (uint8_t*) check_err(mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0), "reserve address space");
+	uint8_t* virt = (uint8_t*) ((((uintptr_t) reserved) + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+	if (virt != reserved) {
+		munmap(reserved, virt - reserved);
+	}
+	if (virt + size != reserved + size + HUGE_PAGE_SIZE) {
+		munmap(virt + size, reserved + size + HUGE_PAGE_SIZE - (virt + size));
+	}
+	for (uint32_t i = 0; i < num_pages; i++) {
+		// mapping the same file again gives us the same physical page
+		check_err(map_huge_pages(candidates[run_start + i].fd, HUGE_PAGE_SIZE, node, virt + ((size_t) i << HUGE_PAGE_BITS), MAP_FIXED), "remap huge page");
+	}
+	// the old mappings of the pages in the run go away, all others are given back to the kernel
+	for (uint32_t i = 0; i < num_candidates; i++) {
+		munmap(candidates[i].virt, HUGE_PAGE_SIZE);
+		close(candidates[i].fd);
+	}
+	uintptr_t phy = candidates[run_start].phy;
+	free(candidates);
+	if (virt_to_phys(virt + size - HUGE_PAGE_SIZE) != phy + size - HUGE_PAGE_SIZE) {
+		error("remapped huge pages are not physically contiguous");
+	}
+	__sync_fetch_and_add(&huge_pages_in_use, num_pages);
+	return (struct dma_memory) {
+		.virt = virt,
+		.phy = phy
+	};
+}
+
+// small allocations (e.g., descriptor rings) are co-located on a shared huge page instead of wasting a whole page
+// everything on the arena page is physically contiguous, so require_contiguous is trivially satisfied
+// nothing is ever freed, the arena only moves forward and a new page is started once a request doesn't fit
+// there is one arena per NUMA node, the first one is for allocations that don't care about the node
+// large contiguous allocations use a separate set of arenas backed by 1 GB pages
+struct dma_arena {
+	struct dma_memory page;
+	size_t used;
+};
+static struct dma_arena dma_arenas[MAX_NUMA_NODES + 1];
+static struct dma_arena dma_arenas_1g[MAX_NUMA_NODES + 1];
+static volatile uint32_t dma_arena_lock;
+
+// tries to allocate from the 1 GB page arena, returns false if there are no (more) 1 GB pages
+static bool allocate_from_1g_arena(struct dma_arena* arena, size_t size, size_t alignment, int node, struct dma_memory* mem) {
+	if (size > HUGE_PAGE_1G_SIZE) {
+		return false;
+	}
+	arena->used = (arena->used + alignment - 1) & ~(alignment - 1);
+	if (!arena->page.virt || arena->used + size > HUGE_PAGE_1G_SIZE) {
+		void* virt = map_new_huge_pages(HUGE_PAGE_1G_SIZE, true, node, NULL);
+		if (virt == MAP_FAILED) {
+			return false;
+		}
+		arena->page = (struct dma_memory) {
+			.virt = virt,
+			.phy = virt_to_phys(virt)
+		};
+		arena->used = 0;
+		__sync_fetch_and_add(&huge_pages_in_use, HUGE_PAGE_1G_SIZE >> HUGE_PAGE_BITS);
+	}
+	mem->virt = (uint8_t*) arena->page.virt + arena->used;
+	mem->phy = arena->page.phy + arena->used;
+	arena->used += size;
+	return true;
+}
+
+// allocate memory suitable for DMA access in huge pages on the given NUMA node (or NUMA_NODE_ANY)
+// requests smaller than a huge page share pages, larger requests are rounded up to multiples of the huge page size
+// physically contiguous requests larger than a huge page are served from 1 GB pages if available (for hugetlbfs:
+// mounted with pagesize=1G at /mnt/huge-1G), otherwise we search for adjacent 2 MB pages
+// alignment is a power of two (at least DMA_ALIGNMENT) of both the virtual and the physical address
+struct dma_memory memory_allocate_dma_aligned(size_t size, bool require_contiguous, int node, size_t alignment) {
+	if (node < NUMA_NODE_ANY || node >= MAX_NUMA_NODES) {
+		error("invalid NUMA node %d", node);
+	}
+	if (alignment < DMA_ALIGNMENT || alignment > HUGE_PAGE_SIZE || (alignment & (alignment - 1))) {
+		error("invalid DMA alignment %zu", alignment);
+	}
+	if (shared_mode == SHARED_SECONDARY) {
+		error("secondary processes can't allocate DMA memory, allocate it in the primary process");
+	}
+	if (size >= HUGE_PAGE_SIZE && !(require_contiguous && size > HUGE_PAGE_SIZE)) {
+		return allocate_huge_pages(size, node);
+	}
+	// the size is a multiple of the 128 byte 82599 dma requirement, so the next allocation is aligned as well
+	size = (size + DMA_ALIGNMENT - 1) & ~((size_t) DMA_ALIGNMENT - 1);
+	while (__sync_lock_test_and_set(&dma_arena_lock, 1)) {
+		_mm_pause();
+	}
+	struct dma_memory mem;
+	if (size > HUGE_PAGE_SIZE) {
+		// NUMA_NODE_ANY is -1
+		if (!allocate_from_1g_arena(&dma_arenas_1g[node + 1], size, alignment, node, &mem)) {
+			debug("no 1 GB huge pages available, searching for %zu bytes of contiguous 2 MB pages", size);
+			mem = allocate_contiguous_run((size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1), node);
+		}
+	} else {
+		struct dma_arena* arena = &dma_arenas[node + 1];
+		// huge pages are aligned to more than any valid alignment, a new page needs no padding
+		arena->used = (arena->used + alignment - 1) & ~(alignment - 1);
+		if (!arena->page.virt || arena->used + size > HUGE_PAGE_SIZE) {
+			// the remainder of the old page is lost, but that's at most one page per allocation pattern change
+			arena->page = allocate_huge_pages(HUGE_PAGE_SIZE, node);
+			arena->used = 0;
+		}
+		mem.virt = (uint8_t*) arena->page.virt + arena->used;
+		mem.phy = arena->page.phy + arena->used;
+		arena->used += size;
+	}
+	__sync_lock_release(&dma_arena_lock);
+	return mem;
+}
+
+struct dma_memory memory_allocate_dma_node(size_t size, bool require_contiguous, int node) {
+	return memory_allocate_dma_aligned(size, require_contiguous, node, DMA_ALIGNMENT);
+}
+
+struct dma_memory memory_allocate_dma(size_t size, bool require_contiguous) {
+	return memory_allocate_dma_node(size, require_contiguous, NUMA_NODE_ANY);
+}
+
+// memory for mempools and driver state, zero-initialized and cache line aligned
+// this is shared with the secondaries if called in the primary process of the shared memory mode
+void* memory_allocate_metadata(size_t size) {
+	void* mem;
+	if (shared_mode == SHARED_PRIMARY) {
+		mem = memory_allocate_dma(size, false).virt;
+	} else {
+		// aligned_alloc wants a size that is a multiple of the alignment
+		mem = aligned_alloc(64, (size + 63) & ~63ull);
+		if (!mem) {
+			error("failed to allocate %zu bytes of metadata", size);
+		}
+	}
+	memset(mem, 0, size);
+	return mem;
+}
+
+static struct shared_registry* map_shared_registry(const char* name, bool create) {
+	if (strlen(name) >= MAX_SHARED_NAME || strchr(name, '/')) {
+		error("invalid name for shared memory: %s", name);
+	}
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s/ixy-%s", SHARED_REGISTRY_DIR, name);
+	int fd = check_err(open(path, create ? O_CREAT | O_TRUNC | O_RDWR : O_RDWR, S_IRWXU), "open shared memory registry");
+	if (create) {
+		check_err(ftruncate(fd, sizeof(struct shared_registry)), "resize shared memory registry");
+	}
+	struct shared_registry* registry = (struct shared_registry*) check_err(mmap(NULL, sizeof(struct shared_registry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0), "mmap shared memory registry");
+	close(fd);
+	strcpy(shared_name, name);
+	return registry;
+}
+
+// removes huge page files left behind by a previous primary with the same name
+static void remove_shared_files(const char* dir_path, const char* name) {
+	DIR* dir = opendir(dir_path);
+	if (!dir) {
+		return;
+	}
+	char prefix[MAX_SHARED_NAME + 8];
+	snprintf(prefix, sizeof(prefix), "ixy-%s-", name);
+	struct dirent* entry;
+	while ((entry = readdir(dir))) {
+		if (!strncmp(entry->d_name, prefix, strlen(prefix))) {
+			char path[PATH_MAX];
+			snprintf(path, PATH_MAX, "%s/%s", dir_path, entry->d_name);
+			debug("removing stale shared memory file %s", path);
+			unlink(path);
+		}
+	}
+	closedir(dir);
+}
+
+// makes this process the primary process of the shared memory group called name, must be called before anything else
+// all DMA memory and driver state allocated afterwards can be attached to by secondaries (see memory_share_attach)
+// the memory is kept in hugetlbfs files (/mnt/huge/ixy-<name>-*) that outlive the process, they are only removed
+// when a new primary with the same name starts, remove them manually to get the huge pages back
+void memory_share_init(const char* name) {
+	if (shared_mode != SHARED_NONE) {
+		error("shared memory mode is already configured");
+	}
+	remove_shared_files(HUGE_MOUNT, name);
+	remove_shared_files(HUGE_MOUNT_1G, name);
+	struct shared_registry* registry = map_shared_registry(name, true);
+	// threads that already have an id keep it
+	registry->thread_ids_in_use = thread_ids_in_use;
+	registry->next_addr = SHARED_BASE_ADDR;
+	__atomic_store_n(&registry->magic, SHARED_REGISTRY_MAGIC, __ATOMIC_RELEASE);
+	shared_registry = registry;
+	shared_mode = SHARED_PRIMARY;
+	info("primary process of shared memory group %s", name);
+}
+
+// makes this process a secondary process of the shared memory group called name
+// maps all DMA memory allocated by the primary so far at the same addresses, i.e., the primary should have created
+// all devices and mempools before; secondaries can't allocate DMA memory themselves
+void memory_share_attach(const char* name) {
+	if (shared_mode != SHARED_NONE) {
+		error("shared memory mode is already configured");
+	}
+	struct shared_registry* registry = map_shared_registry(name, false);
+	if (__atomic_load_n(&registry->magic, __ATOMIC_ACQUIRE) != SHARED_REGISTRY_MAGIC) {
+		error("shared memory group %s is not initialized", name);
+	}
+	uint32_t num_mappings = __atomic_load_n(&registry->num_mappings, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < num_mappings; i++) {
+		void* virt = (void*) registry->mappings[i].virt;
+		size_t size = registry->mappings[i].size;
+		int fd = check_err(open(registry->mappings[i].path, O_RDWR), "open shared huge page file");
+		void* mapped = mmap(virt, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB | MAP_FIXED_NOREPLACE, fd, 0);
+		close(fd);
+		if (mapped != virt) {
+			error("can't map shared memory at %p, the address range is already in use in this process", virt);
+		}
+	}
+	shared_registry = registry;
+	shared_mode = SHARED_SECONDARY;
+	info("attached to shared memory group %s, %u mappings", name, num_mappings);
+}
+
+bool memory_share_is_primary() {
+	return shared_mode == SHARED_PRIMARY;
+}
+
+// makes a pointer to shared memory available to secondaries under the given name, primary only
+void memory_share_publish(const char* name, void* ptr) {
+	if (shared_mode != SHARED_PRIMARY) {
+		error("only the primary process can publish shared objects");
+	}
+	if (strlen(name) >= MAX_SHARED_NAME) {
+		error("name of shared object too long: %s", name);
+	}
+	while (__sync_lock_test_and_set(&shared_registry_lock, 1)) {
+		_mm_pause();
+	}
+	uint32_t id = shared_registry->num_objects;
+	if (id == MAX_SHARED_OBJECTS) {
+		error("too many shared objects, increase MAX_SHARED_OBJECTS");
+	}
+	strcpy(shared_registry->objects[id].name, name);
+	shared_registry->objects[id].ptr = ptr;
+	__atomic_store_n(&shared_registry->num_objects, id + 1, __ATOMIC_RELEASE);
+	__sync_lock_release(&shared_registry_lock);
+}
+
+// returns the pointer published under name, NULL if not found or not in shared memory mode
+void* memory_share_lookup(const char* name) {
+	if (!shared_registry) {
+		return NULL;
+	}
+	uint32_t num_objects = __atomic_load_n(&shared_registry->num_objects, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < num_objects; i++) {
+		if (!strcmp(shared_registry->objects[i].name, name)) {
+			return shared_registry->objects[i].ptr;
+		}
+	}
+	return NULL;
+}
+
+// number of huge pages allocated for DMA memory, including partially used arena pages
+// 1 GB pages are counted as multiple pages of HUGE_PAGE_SIZE
+uint32_t memory_huge_pages_in_use() {
+	return __atomic_load_n(&huge_pages_in_use, __ATOMIC_RELAXED);
+}
+
+// tracks the lowest fill level of the ring and fires the low watermark callback when falling below the threshold
+// only called once per allocation that touched the ring, after the dequeue is complete: the callback may use the pool
+static inline void check_free_level(struct mempool* mempool, uint32_t num_free) {
+	uint32_t min_free = __atomic_load_n(&mempool->low_watermark.min_free, __ATOMIC_RELAXED);
+	while (num_free < min_free) {
+		if (__atomic_compare_exchange_n(&mempool->low_watermark.min_free, &min_free, num_free, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	// exactly one thread gets to call the callback until it is re-armed in ring_enqueue
+	// the callback is a function pointer of the primary, secondaries leave it to the primary's next allocation
+	if (num_free < mempool->low_watermark.threshold && mempool->low_watermark.armed && shared_mode != SHARED_SECONDARY
+		&& __atomic_exchange_n(&mempool->low_watermark.armed, 0, __ATOMIC_RELAXED)) {
+		mempool->low_watermark.callback(mempool, num_free, mempool->low_watermark.arg);
+	}
+}
+
+// the ring below is the classic multi-producer/multi-consumer ring (see DPDK's rte_ring or FreeBSD's buf_ring)
+// producers/consumers first reserve a range of slots by moving head with a CAS, copy their entries,
+// and then wait for all previous reservations to complete before moving tail to publish their slots
+// all indices are free-running 32 bit counters, wrap-around is handled by unsigned arithmetic
+// the __atomic builtins are available since gcc 4.7 and compile to plain movs on x86
+static void ring_enqueue(struct mempool* mempool, const uint32_t* ids, uint32_t n) {
+	uint32_t size = mempool->ring_mask + 1;
+	uint32_t head, next;
+	do {
+		head = __atomic_load_n(&mempool->prod.head, __ATOMIC_RELAXED);
+		uint32_t free_entries = size + __atomic_load_n(&mempool->cons.tail, __ATOMIC_ACQUIRE) - head;
+		if (free_entries < n) {
+			// the ring is large enough to hold all entries, so this only happens on double frees
+			error("mempool %p overflowed, a buf was probably free'd twice", mempool);
+		}
+		next = head + n;
+	} while (!__atomic_compare_exchange_n(&mempool->prod.head, &head, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	for (uint32_t i = 0; i < n; i++) {
+		mempool->ring[(head + i) & mempool->ring_mask] = ids[i];
+	}
+	// wait for other producers that reserved slots before us
+	while (__atomic_load_n(&mempool->prod.tail, __ATOMIC_RELAXED) != head) {
+		_mm_pause();
+	}
+	__atomic_store_n(&mempool->prod.tail, next, __ATOMIC_RELEASE);
+	if (mempool->low_watermark.threshold && !mempool->low_watermark.armed
+		&& next - __atomic_load_n(&mempool->cons.tail, __ATOMIC_RELAXED) >= mempool->low_watermark.threshold) {
+		mempool->low_watermark.armed = 1;
+	}
+}
+
+// dequeues up to n entries, returns the number of entries dequeued and the entries left in the ring in num_free
+static uint32_t ring_dequeue(struct mempool* mempool, uint32_t* ids, uint32_t n, uint32_t* num_free) {
+	uint32_t head, next, entries;
+	do {
+		head = __atomic_load_n(&mempool->cons.head, __ATOMIC_RELAXED);
+		entries = __atomic_load_n(&mempool->prod.tail, __ATOMIC_ACQUIRE) - head;
+		if (entries < n) {
+			n = entries;
+		}
+		*num_free = entries - n;
+		if (n == 0) {
+			return 0;
+		}
+		next = head + n;
+	} while (!__atomic_compare_exchange_n(&mempool->cons.head, &head, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	for (uint32_t i = 0; i < n; i++) {
+		ids[i] = mempool->ring[(head + i) & mempool->ring_mask];
+	}
+	// wait for other consumers that reserved slots before us
+	while (__atomic_load_n(&mempool->cons.tail, __ATOMIC_RELAXED) != head) {
+		_mm_pause();
+	}
+	__atomic_store_n(&mempool->cons.tail, next, __ATOMIC_RELEASE);
+	return n;
+}
+
+// in shared memory mode, the ids are tracked in the registry to keep them unique over all processes
+static inline volatile uint64_t* get_thread_ids_in_use() {
+	return shared_registry ? &shared_registry->thread_ids_in_use : &thread_ids_in_use;
+}
+
+static void release_thread_id(void* arg) {
+	if (thread_id >= 0 && thread_id < MEMPOOL_MAX_THREADS) {
+		// release: the next owner of the id must see the last state of the caches
+		__atomic_fetch_and(get_thread_ids_in_use(), ~(1ull << thread_id), __ATOMIC_RELEASE);
+	}
+	thread_id = -1;
+}
+
+static void create_thread_id_key() {
+	if (pthread_key_create(&thread_id_key, release_thread_id)) {
+		error("failed to create the thread id key");
+	}
+}
+
+static int32_t acquire_thread_id() {
+	volatile uint64_t* ids_in_use = get_thread_ids_in_use();
+	uint64_t used = __atomic_load_n(ids_in_use, __ATOMIC_RELAXED);
+	while (~used) {
+		int32_t id = __builtin_ctzll(~used);
+		if (__atomic_compare_exchange_n(ids_in_use, &used, used | (1ull << id), false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			// the destructor is only called for a non-NULL value
+			pthread_once(&thread_id_key_once, create_thread_id_key);
+			pthread_setspecific(thread_id_key, (void*) 1);
+			return id;
+		}
+	}
+	return MEMPOOL_MAX_THREADS;
+}
+
+static inline int32_t get_thread_id() {
+	if (thread_id < 0) {
+		thread_id = acquire_thread_id();
+	}
+	return thread_id;
+}
+
+static inline struct mempool_cache* get_cache(struct mempool* mempool) {
+	if (!mempool->cache_size || get_thread_id() >= MEMPOOL_MAX_THREADS) {
+		return NULL;
+	}
+	return &mempool->caches[thread_id];
+}
+
+// counters live in the cache of the thread even if caching is disabled for the pool
+static inline void count_allocs(struct mempool* mempool, uint32_t allocated, uint32_t failed, uint32_t cache_hits) {
+	if (get_thread_id() < MEMPOOL_MAX_THREADS) {
+		struct mempool_counters* counters = &mempool->caches[thread_id].counters;
+		counters->allocs += allocated;
+		counters->failed_allocs += failed;
+		counters->cache_hits += cache_hits;
+	} else {
+		__atomic_add_fetch(&mempool->shared_counters.allocs, allocated, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mempool->shared_counters.failed_allocs, failed, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mempool->shared_counters.cache_hits, cache_hits, __ATOMIC_RELAXED);
+	}
+}
+
+static inline void count_frees(struct mempool* mempool, uint32_t freed) {
+	if (get_thread_id() < MEMPOOL_MAX_THREADS) {
+		mempool->caches[thread_id].counters.frees += freed;
+	} else {
+		__atomic_add_fetch(&mempool->shared_counters.frees, freed, __ATOMIC_RELAXED);
+	}
+}
+
+static inline struct pkt_buf* entry_to_buf(struct mempool* mempool, uint32_t entry_id) {
+	return (struct pkt_buf*) (((uint8_t*) mempool->base_addr) + entry_id * mempool->buf_size);
+}
+
 // allocate a memory pool from which DMA'able packet buffers can be allocated
-// this is currently not yet thread-safe, i.e., a pool can only be used by one thread,
-// this means a packet can only be sent/received by a single thread
-// entry_size can be 0 to use the default
-struct mempool* memory_allocate_mempool(uint32_t num_entries, uint32_t entry_size) {
+// a pool can be shared between threads, i.e., a packet can be received on one thread and sent/free'd on another
+// entry_size can be 0 to use the default, the bufs are placed on the given NUMA node (or NUMA_NODE_ANY)
+// init is called exactly once for each buf when the pool is created (can be NULL), e.g., to fill in a packet template
+// bufs are then handed out in any order, but their contents stay as set by init until someone changes them
+// bufs start out with PKT_BUF_DIRTY cleared if init is given, set otherwise
+struct mempool* memory_allocate_mempool_init(uint32_t num_entries, uint32_t entry_size, int node, void (*init)(struct pkt_buf* buf, void* arg), void* arg) {
 	entry_size = entry_size ? entry_size : 2048;
 	// require entries that neatly fit into the page size, this makes the memory pool much easier
 	// otherwise our base_addr + index * size formula would be wrong because we can't cross a page-boundary
 	if (HUGE_PAGE_SIZE % entry_size) {
 		error("entry size must be a divisor of the huge page size (%d)", HUGE_PAGE_SIZE);
 	}
-	struct mempool* mempool = (struct mempool*) malloc(sizeof(struct mempool) + num_entries * sizeof(uint32_t));
-	struct dma_memory mem = memory_allocate_dma(num_entries * entry_size, false);
+	uint32_t ring_size = 1;
+	while (ring_size < num_entries) {
+		ring_size <<= 1;
+	}
+	size_t mempool_size = sizeof(struct mempool) + ring_size * sizeof(uint32_t);
+	struct mempool* mempool = (struct mempool*) memory_allocate_metadata(mempool_size);
+	struct dma_memory mem = memory_allocate_dma_node((size_t) num_entries * entry_size, false, node);
 	mempool->num_entries = num_entries;
 	mempool->buf_size = entry_size;
 	mempool->base_addr = mem.virt;
-	mempool->free_stack_top = num_entries;
+	// caches must be small compared to the pool, otherwise a few threads can starve the others
+	mempool->cache_size = num_entries / 16 < MEMPOOL_CACHE_SIZE ? num_entries / 16 : MEMPOOL_CACHE_SIZE;
+	mempool->ring_mask = ring_size - 1;
+	mempool->prod.head = mempool->prod.tail = num_entries;
+	mempool->low_watermark.min_free = num_entries;
+	// physical addresses are not contiguous within a pool, we need to get the mapping
+	// but it's only needed once per huge page, the address of a buf is page address + offset
+	size_t pool_size = (size_t) num_entries * entry_size;
+	uintptr_t* page_phys = (uintptr_t*) malloc(((pool_size >> HUGE_PAGE_BITS) + 2) * sizeof(uintptr_t));
+	uintptr_t first_page = virt_to_phys_region(mem.virt, pool_size, page_phys);
 	for (uint32_t i = 0; i < num_entries; i++) {
-		mempool->free_stack[i] = i;
-		struct pkt_buf* buf = (struct pkt_buf*) (((uint8_t*) mempool->base_addr) + i * entry_size);
-		// physical addresses are not contiguous within a pool, we need to get the mapping
-		// minor optimization opportunity: this only needs to be done once per page
-		buf->buf_addr_phy = virt_to_phys(buf);
+		mempool->ring[i] = i;
+		struct pkt_buf* buf = entry_to_buf(mempool, i);
+		uintptr_t page_offset = (uintptr_t) buf - first_page;
+		buf->buf_addr_phy = page_phys[page_offset >> HUGE_PAGE_BITS] + (page_offset & (HUGE_PAGE_SIZE - 1));
 		buf->mempool_idx = i;
 		buf->mempool = mempool;
 		buf->size = 0;
+		buf->next = NULL;
+		buf->pkt_len = 0;
+		buf->nb_segs = 1;
+		buf->refcnt = 1;
+		buf->flags = init ? 0 : PKT_BUF_DIRTY;
+		if (init) {
+			init(buf, arg);
+		}
 	}
+	free(page_phys);
 	return mempool;
 }
 
+struct mempool* memory_allocate_mempool_node(uint32_t num_entries, uint32_t entry_size, int node) {
+	return memory_allocate_mempool_init(num_entries, entry_size, node, NULL, NULL);
+}
+
+struct mempool* memory_allocate_mempool(uint32_t num_entries, uint32_t entry_size) {
+	return memory_allocate_mempool_node(num_entries, entry_size, NUMA_NODE_ANY);
+}
+
+// can be called from any thread at any time, the counters of other threads may lag slightly behind
+void mempool_read_stats(struct mempool* mempool, struct mempool_stats* stats) {
+	struct mempool_counters sum = mempool->shared_counters;
+	for (uint32_t i = 0; i < MEMPOOL_MAX_THREADS; i++) {
+		struct mempool_counters* counters = &mempool->caches[i].counters;
+		sum.allocs += __atomic_load_n(&counters->allocs, __ATOMIC_RELAXED);
+		sum.frees += __atomic_load_n(&counters->frees, __ATOMIC_RELAXED);
+		sum.failed_allocs += __atomic_load_n(&counters->failed_allocs, __ATOMIC_RELAXED);
+		sum.cache_hits += __atomic_load_n(&counters->cache_hits, __ATOMIC_RELAXED);
+	}
+	stats->allocs = sum.allocs;
+	stats->frees = sum.frees;
+	stats->failed_allocs = sum.failed_allocs;
+	stats->cache_hits = sum.cache_hits;
+	stats->num_free = __atomic_load_n(&mempool->prod.tail, __ATOMIC_RELAXED) - __atomic_load_n(&mempool->cons.tail, __ATOMIC_RELAXED);
+	stats->min_free = __atomic_load_n(&mempool->low_watermark.min_free, __ATOMIC_RELAXED);
+	stats->max_in_use = mempool->num_entries - stats->min_free;
+}
+
+// callback is called when the number of free bufs in the shared ring falls below threshold (0 disables it)
+// it runs in the thread that tried to allocate and fires once until the pool recovered to the threshold
+// use it to shed load before the pool runs dry, e.g., by dropping packets instead of forwarding them
+// in shared memory mode, only the primary can set it and the callback only runs in the primary
+void mempool_set_low_watermark(struct mempool* mempool, uint32_t threshold, void (*callback) (struct mempool* mempool, uint32_t num_free, void* arg), void* arg) {
+	if (shared_mode == SHARED_SECONDARY) {
+		error("the low watermark of a shared mempool can only be set by the primary process");
+	}
+	mempool->low_watermark.callback = callback;
+	mempool->low_watermark.arg = arg;
+	mempool->low_watermark.armed = 1;
+	__atomic_store_n(&mempool->low_watermark.threshold, callback ? threshold : 0, __ATOMIC_RELEASE);
+}
+
+// num_free is the lowest fill level of the ring seen by the dequeues
+static uint32_t alloc_from_ring(struct mempool* mempool, struct pkt_buf* bufs[], uint32_t num_bufs, uint32_t* num_free) {
+	uint32_t num_allocated = 0;
+	*num_free = UINT32_MAX;
+	while (num_allocated < num_bufs) {
+		uint32_t ids[64];
+		uint32_t chunk = num_bufs - num_allocated < 64 ? num_bufs - num_allocated : 64;
+		uint32_t level;
+		uint32_t num_dequeued = ring_dequeue(mempool, ids, chunk, &level);
+		*num_free = level < *num_free ? level : *num_free;
+		for (uint32_t i = 0; i < num_dequeued; i++) {
+			bufs[num_allocated++] = entry_to_buf(mempool, ids[i]);
+		}
+		if (num_dequeued < chunk) {
+			break;
+		}
+	}
+	return num_allocated;
+}
+
 uint32_t pkt_buf_alloc_batch(struct mempool* mempool, struct pkt_buf* bufs[], uint32_t num_bufs) {
-	if (mempool->free_stack_top < num_bufs) {
-		warn("memory pool %p only has %d free bufs, requested %d", mempool, mempool->free_stack_top, num_bufs);
-		num_bufs = mempool->free_stack_top;
+	struct mempool_cache* cache = get_cache(mempool);
+	uint32_t num_allocated;
+	uint32_t cache_hits = 0;
+	// fill level of the ring if we dequeued from it, checked against the low watermark once we are done
+	uint32_t num_free = UINT32_MAX;
+	if (cache && num_bufs <= mempool->cache_size) {
+		if (cache->len >= num_bufs) {
+			cache_hits = num_bufs;
+		} else {
+			// refill the cache with a single ring operation, enough to serve this and the next few requests
+			cache->len += ring_dequeue(mempool, cache->objs + cache->len, mempool->cache_size + num_bufs - cache->len, &num_free);
+		}
+		num_allocated = cache->len < num_bufs ? cache->len : num_bufs;
+		for (uint32_t i = 0; i < num_allocated; i++) {
+			bufs[i] = entry_to_buf(mempool, cache->objs[--cache->len]);
+		}
+	} else {
+		// large requests bypass the cache
+		num_allocated = alloc_from_ring(mempool, bufs, num_bufs, &num_free);
 	}
-	for (uint32_t i = 0; i < num_bufs; i++) {
-		uint32_t entry_id = mempool->free_stack[--mempool->free_stack_top];
-		bufs[i] = (struct pkt_buf*) (((uint8_t*) mempool->base_addr) + entry_id * mempool->buf_size);
+	// running out of bufs is not an error, e.g., rx just tries again later; see failed_allocs in mempool_read_stats
+	count_allocs(mempool, num_allocated, num_bufs - num_allocated, cache_hits);
+	if (num_free != UINT32_MAX) {
+		check_free_level(mempool, num_free);
+	}
+	return num_allocated;
+}
+
+// returns the bufs in the cache of the calling thread to the ring, e.g., before a worker thread exits
+// without this, they stay in the cache until a new thread takes over the thread id
+void mempool_cache_flush(struct mempool* mempool) {
+	if (thread_id < 0 || thread_id >= MEMPOOL_MAX_THREADS) {
+		return;
+	}
+	struct mempool_cache* cache = &mempool->caches[thread_id];
+	if (cache->len) {
+		ring_enqueue(mempool, cache->objs, cache->len);
+		cache->len = 0;
 	}
-	return num_bufs;
 }
 
 struct pkt_buf* pkt_buf_alloc(struct mempool* mempool) {
@@ -108,8 +960,180 @@ struct pkt_buf* pkt_buf_alloc(struct mempool* mempool) {
 	return buf;
 }
 
+// drops one reference, returns true if it was the last one
+static inline bool release_ref(struct pkt_buf* buf) {
+	// a refcnt of 1 means that nobody else can touch the buf, the common case doesn't need an atomic operation
+	if (buf->refcnt == 1) {
+		return true;
+	}
+	return __atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// returns entries to the pool, the per-thread cache takes them if they fit, everything else goes to the ring at once
+static void mempool_put(struct mempool* mempool, const uint32_t* ids, uint32_t n) {
+	count_frees(mempool, n);
+	struct mempool_cache* cache = get_cache(mempool);
+	if (!cache || n > mempool->cache_size) {
+		ring_enqueue(mempool, ids, n);
+		return;
+	}
+	if (cache->len + n > mempool->cache_size * 2) {
+		// flush the upper half, the lower half stays for the next allocations
+		ring_enqueue(mempool, cache->objs + mempool->cache_size, cache->len - mempool->cache_size);
+		cache->len = mempool->cache_size;
+	}
+	memcpy(cache->objs + cache->len, ids, n * sizeof(*ids));
+	cache->len += n;
+}
+
+// collects the entries of segments that lost their last reference, runs of bufs from the same pool are returned at once
+struct free_batch {
+	struct mempool* mempool;
+	uint32_t len;
+	uint32_t ids[MEMPOOL_CACHE_SIZE];
+};
+
+static inline void free_batch_flush(struct free_batch* batch) {
+	if (batch->len) {
+		mempool_put(batch->mempool, batch->ids, batch->len);
+		batch->len = 0;
+	}
+}
+
+// restores the invariant for bufs in the pool after the last reference was dropped
+static inline void reset_buf(struct pkt_buf* buf) {
+	buf->next = NULL;
+	buf->nb_segs = 1;
+	buf->refcnt = 1;
+}
+
+// adds a buf that lost its last reference
+static inline void free_batch_put(struct free_batch* batch, struct pkt_buf* buf) {
+	reset_buf(buf);
+	if (buf->mempool != batch->mempool || batch->len == MEMPOOL_CACHE_SIZE) {
+		free_batch_flush(batch);
+		batch->mempool = buf->mempool;
+	}
+	batch->ids[batch->len++] = buf->mempool_idx;
+}
+
+static inline void free_batch_add(struct free_batch* batch, struct pkt_buf* buf) {
+	if (release_ref(buf)) {
+		free_batch_put(batch, buf);
+	}
+}
+
+// drops a reference to a single segment and returns it to the pool if it was the last one
+// pkt_buf_free handles the whole chain
+void pkt_buf_free_seg(struct pkt_buf* buf) {
+	if (!release_ref(buf)) {
+		return;
+	}
+	reset_buf(buf);
+	mempool_put(buf->mempool, &buf->mempool_idx, 1);
+}
+
+// same as calling pkt_buf_free_seg for each buf, but bufs from the same mempool are returned in one operation
+// this is what drivers use to give back a batch of sent tx descriptors
+void pkt_buf_free_seg_batch(struct pkt_buf* bufs[], uint32_t num_bufs) {
+	struct free_batch batch = { .mempool = NULL, .len = 0 };
+	for (uint32_t i = 0; i < num_bufs; i++) {
+		free_batch_add(&batch, bufs[i]);
+	}
+	free_batch_flush(&batch);
+}
+
+// frees num_bufs packets (including all their segments), much faster than calling pkt_buf_free for each one
+// bufs can come from different mempools, consecutive bufs from the same pool are grouped
+void pkt_buf_free_batch(struct pkt_buf* bufs[], uint32_t num_bufs) {
+	struct free_batch batch = { .mempool = NULL, .len = 0 };
+	for (uint32_t i = 0; i < num_bufs; i++) {
+		struct pkt_buf* buf = bufs[i];
+		do {
+			// the next pointer is reset when the segment goes back to the pool
+			struct pkt_buf* next = buf->next;
+			free_batch_add(&batch, buf);
+			buf = next;
+		} while (buf);
+	}
+	free_batch_flush(&batch);
+}
+
+// pkt_buf_free is the same as pkt_buf_unref: a shared buf is only returned to the pool once all users freed it
 void pkt_buf_free(struct pkt_buf* buf) {
-	struct mempool* mempool = buf->mempool;
-	mempool->free_stack[mempool->free_stack_top++] = buf->mempool_idx;
+	pkt_buf_unref(buf);
+}
+
+// adds a reference to all segments of a packet, e.g., to pass the same buf to the tx queues of several ports
+// every reference must be dropped by pkt_buf_unref (or pkt_buf_free), tx queues do this once the buf is sent
+// shared bufs must be treated as read-only
+void pkt_buf_ref(struct pkt_buf* buf) {
+	do {
+		__atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+		buf = buf->next;
+	} while (buf);
+}
+
+void pkt_buf_unref(struct pkt_buf* buf) {
+	do {
+		// the next pointer is only reset once the segment goes back to the pool, so it's still valid here
+		struct pkt_buf* next = buf->next;
+		pkt_buf_free_seg(buf);
+		buf = next;
+	} while (buf);
+}
+
+// size is rounded up to a power of two
+struct recycle_ring* recycle_ring_create(struct mempool* mempool, uint32_t size) {
+	uint32_t ring_size = 1;
+	while (ring_size < size) {
+		ring_size <<= 1;
+	}
+	size_t mem_size = sizeof(struct recycle_ring) + ring_size * sizeof(struct pkt_buf*);
+	struct recycle_ring* ring = (struct recycle_ring*) memory_allocate_metadata(mem_size);
+	ring->mempool = mempool;
+	ring->mask = ring_size - 1;
+	return ring;
+}
+
+// takes up to num_bufs bufs out of the ring, only one thread may call this for a given ring
+uint32_t recycle_ring_get(struct recycle_ring* ring, struct pkt_buf* bufs[], uint32_t num_bufs) {
+	uint32_t tail = ring->tail;
+	uint32_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	uint32_t n = available < num_bufs ? available : num_bufs;
+	for (uint32_t i = 0; i < n; i++) {
+		bufs[i] = ring->bufs[(tail + i) & ring->mask];
+	}
+	__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
 }
 
+// drops a reference to each segment like pkt_buf_free_seg_batch, but bufs from the ring's mempool are put into the
+// ring instead of the mempool as long as it has space; only one thread may call this for a given ring
+void pkt_buf_recycle_seg_batch(struct recycle_ring* ring, struct pkt_buf* bufs[], uint32_t num_bufs) {
+	struct free_batch batch = { .mempool = NULL, .len = 0 };
+	uint32_t head = ring->head;
+	uint32_t free_slots = ring->mask + 1 - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+	for (uint32_t i = 0; i < num_bufs; i++) {
+		struct pkt_buf* buf = bufs[i];
+		if (!release_ref(buf)) {
+			continue;
+		}
+		if (buf->mempool == ring->mempool && free_slots) {
+			reset_buf(buf);
+			ring->bufs[head++ & ring->mask] = buf;
+			free_slots--;
+		} else {
+			free_batch_put(&batch, buf);
+		}
+	}
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	free_batch_flush(&batch);
+}
+
+// appends seg to the packet starting at head, tail is the current last segment (head for single-segment packets)
+void pkt_buf_append_seg(struct pkt_buf* head, struct pkt_buf* tail, struct pkt_buf* seg) {
+	tail->next = seg;
+	head->nb_segs++;
+	head->pkt_len += seg->size;
+}
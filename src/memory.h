@@ -9,32 +9,169 @@
 
 #define HUGE_PAGE_BITS 21
 #define HUGE_PAGE_SIZE (1 << HUGE_PAGE_BITS)
-#define SIZE_PKT_BUF_HEADROOM 40
+#define SIZE_PKT_BUF_HEADROOM 24
+// all DMA allocations are aligned to this, the 82599 requires 128 byte aligned descriptor rings
+#define DMA_ALIGNMENT 128
+
+// NUMA node parameter for allocations that can be placed anywhere
+#define NUMA_NODE_ANY -1
+#define MAX_NUMA_NODES 64
+
+// flags of struct pkt_buf
+// the contents may differ from what the init function of the mempool wrote, set by drivers on rx
+// applications that modify more than the fields they always rewrite set it as well, see memory_allocate_mempool_init
+#define PKT_BUF_DIRTY         0x01
+
+// ol_flags of struct pkt_buf_meta, tell which offload results are present
+#define PKT_RX_RSS_HASH       0x01 // rss_hash is valid
+#define PKT_RX_VLAN           0x02 // packet had a VLAN tag, vlan_tci is valid
+#define PKT_RX_IP_CKSUM_GOOD  0x04
+#define PKT_RX_IP_CKSUM_BAD   0x08
+#define PKT_RX_L4_CKSUM_GOOD  0x10 // TCP or UDP checksum
+#define PKT_RX_L4_CKSUM_BAD   0x20
+#define PKT_RX_TIMESTAMP      0x40 // timestamp is valid
+
+// packet_type of struct pkt_buf_meta, headers identified by the nic (0 if it didn't recognize anything)
+#define PKT_TYPE_IPV4         0x0001
+#define PKT_TYPE_IPV6         0x0002
+#define PKT_TYPE_IP_EXT       0x0004 // IPv4 options or IPv6 extension headers
+#define PKT_TYPE_TCP          0x0010
+#define PKT_TYPE_UDP          0x0020
+#define PKT_TYPE_SCTP         0x0040
+
+// per-packet metadata in the head room of the first segment, filled by the drivers on rx
+// saves applications from parsing the headers again if the nic already did it
+struct pkt_buf_meta {
+	// scratch space for the application, ixy never touches this
+	uint32_t user;
+	// port_id of the device and queue the packet was received on
+	uint8_t port;
+	// PKT_RX_* flags
+	uint8_t ol_flags;
+	uint16_t queue;
+	// tag control information (PCP, DEI, VLAN ID), host byte order
+	uint16_t vlan_tci;
+	// PKT_TYPE_* flags
+	uint16_t packet_type;
+	// the rest overlaps with the virtio net header which is written in front of the data on tx
+	uint32_t rss_hash;
+	// nic-specific time format, e.g., ieee 1588 system time on ixgbe
+	uint64_t timestamp;
+};
 
 struct pkt_buf {
 	// physical address to pass a buffer to a nic
 	uintptr_t buf_addr_phy;
 	struct mempool* mempool;
 	uint32_t mempool_idx;
+	// length of the data in this buf (segment)
 	uint32_t size;
-	uint8_t head_room[SIZE_PKT_BUF_HEADROOM];
+	// packets that don't fit into a single buf (e.g., jumbo frames) are a chain of bufs linked here
+	// NULL for the last (or only) segment, bufs in a mempool always have next == NULL and nb_segs == 1
+	struct pkt_buf* next;
+	// total length and number of segments of the packet, only valid in the first segment
+	// drivers set these on rx, tx only looks at size and next of each segment
+	uint32_t pkt_len;
+	uint8_t nb_segs;
+	// PKT_BUF_* flags, kept when the buf goes back to the mempool
+	uint8_t flags;
+	// number of users of this segment, the buf goes back to the mempool once the last one drops its reference
+	// 1 for bufs in a mempool and for freshly allocated bufs, see pkt_buf_ref/pkt_buf_unref
+	volatile uint16_t refcnt;
+	union {
+		uint8_t head_room[SIZE_PKT_BUF_HEADROOM];
+		struct pkt_buf_meta meta;
+	};
 	uint8_t data[] __attribute__((aligned(64)));
 };
 
 static_assert(sizeof(struct pkt_buf) == 64, "pkt_buf too large");
 static_assert(offsetof(struct pkt_buf, data) == 64, "data at unexpected position");
 static_assert(offsetof(struct pkt_buf, head_room) + SIZE_PKT_BUF_HEADROOM == offsetof(struct pkt_buf, data), "head room not immediately before data");
+static_assert(sizeof(struct pkt_buf_meta) == SIZE_PKT_BUF_HEADROOM, "metadata doesn't fill the head room");
+
+// buffers kept in the per-thread caches of a mempool, a cache holds up to twice this many entries
+#define MEMPOOL_CACHE_SIZE 64
+// maximum number of threads at the same time that get a cache, additional threads work directly on the shared ring
+#define MEMPOOL_MAX_THREADS 64
+
+// usage statistics of a mempool, counted separately by each thread, see mempool_read_stats
+struct mempool_counters {
+	uint64_t allocs;
+	uint64_t frees;
+	// bufs requested but not available
+	uint64_t failed_allocs;
+	// allocations served from the per-thread cache without touching the shared ring
+	uint64_t cache_hits;
+};
+
+// only ever written by the thread owning it, no synchronization required
+struct mempool_cache {
+	uint32_t len;
+	uint32_t objs[MEMPOOL_CACHE_SIZE * 2];
+	struct mempool_counters counters;
+} __attribute__((aligned(64)));
+
+struct mempool_stats {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t failed_allocs;
+	uint64_t cache_hits;
+	// free bufs in the shared ring now and the lowest number ever seen, bufs in per-thread caches count as in use
+	uint32_t num_free;
+	uint32_t min_free;
+	// highest number of bufs in use at the same time
+	uint32_t max_in_use;
+};
 
 // everything here contains virtual addresses, the mapping to physical addresses are in the pkt_buf
+// mempools are thread-safe: free bufs are kept in a lock-free multi-producer/multi-consumer ring
+// each thread keeps a small stack of bufs in front of the ring, so the ring is only touched once per batch
 struct mempool {
 	void* base_addr;
 	uint32_t buf_size;
 	uint32_t num_entries;
-	// memory is managed via a simple stack
-	// replacing this with a lock-free queue (or stack) makes this thread-safe
-	uint32_t free_stack_top;
-	// the stack contains the entry id, i.e., base_addr + entry_id * buf_size is the address of the buf
-	uint32_t free_stack[];
+	// number of entries a per-thread cache is filled up to, 0 disables the caches (tiny pools)
+	uint32_t cache_size;
+	// the ring contains the entry id, i.e., base_addr + entry_id * buf_size is the address of the buf
+	// ring size is a power of two >= num_entries, indices are free-running and masked on access
+	uint32_t ring_mask;
+	// producer and consumer indices are on separate cache lines to avoid false sharing
+	// head is reserved with a CAS, tail is published once the entries are copied
+	struct {
+		volatile uint32_t head;
+		volatile uint32_t tail;
+	} prod __attribute__((aligned(64)));
+	struct {
+		volatile uint32_t head;
+		volatile uint32_t tail;
+	} cons __attribute__((aligned(64)));
+	// low watermark alarm and free level tracking, only written when the level hits a new minimum or crosses the mark
+	struct {
+		volatile uint32_t min_free;
+		uint32_t threshold;
+		// cleared when the callback fires, set again once the level is back at the threshold
+		volatile uint32_t armed;
+		// addresses in the primary process in shared memory mode, never called from secondaries
+		void (*callback) (struct mempool* mempool, uint32_t num_free, void* arg);
+		void* arg;
+	} low_watermark __attribute__((aligned(64)));
+	// used by threads beyond MEMPOOL_MAX_THREADS, updated with atomic operations
+	struct mempool_counters shared_counters;
+	struct mempool_cache caches[MEMPOOL_MAX_THREADS];
+	uint32_t ring[] __attribute__((aligned(64)));
+};
+
+// single-producer/single-consumer ring of free bufs that bypasses the mempool
+// used to pass bufs from a tx queue that sent them directly to the rx queue that allocates them again (recycle mode)
+struct recycle_ring {
+	// only bufs from this pool are accepted, the consumer would put foreign bufs into its rx descriptors
+	struct mempool* mempool;
+	uint32_t mask;
+	// written by the producer (tx cleanup) and consumer (rx refill) only, free-running indices masked on access
+	volatile uint32_t head __attribute__((aligned(64)));
+	volatile uint32_t tail __attribute__((aligned(64)));
+	struct pkt_buf* bufs[] __attribute__((aligned(64)));
 };
 
 struct dma_memory {
@@ -43,10 +180,34 @@ struct dma_memory {
 };
 
 struct dma_memory memory_allocate_dma(size_t size, bool require_contiguous);
+struct dma_memory memory_allocate_dma_node(size_t size, bool require_contiguous, int node);
+struct dma_memory memory_allocate_dma_aligned(size_t size, bool require_contiguous, int node, size_t alignment);
+uint32_t memory_huge_pages_in_use();
+void* memory_allocate_metadata(size_t size);
+
+void memory_share_init(const char* name);
+void memory_share_attach(const char* name);
+bool memory_share_is_primary();
+void memory_share_publish(const char* name, void* ptr);
+void* memory_share_lookup(const char* name);
 
 struct mempool* memory_allocate_mempool(uint32_t num_entries, uint32_t entry_size);
+struct mempool* memory_allocate_mempool_node(uint32_t num_entries, uint32_t entry_size, int node);
+struct mempool* memory_allocate_mempool_init(uint32_t num_entries, uint32_t entry_size, int node, void (*init)(struct pkt_buf* buf, void* arg), void* arg);
+void mempool_read_stats(struct mempool* mempool, struct mempool_stats* stats);
+void mempool_set_low_watermark(struct mempool* mempool, uint32_t threshold, void (*callback) (struct mempool* mempool, uint32_t num_free, void* arg), void* arg);
+void mempool_cache_flush(struct mempool* mempool);
 uint32_t pkt_buf_alloc_batch(struct mempool* mempool, struct pkt_buf* bufs[], uint32_t num_bufs);
 struct pkt_buf* pkt_buf_alloc(struct mempool* mempool);
 void pkt_buf_free(struct pkt_buf* buf);
+void pkt_buf_ref(struct pkt_buf* buf);
+void pkt_buf_unref(struct pkt_buf* buf);
+void pkt_buf_free_batch(struct pkt_buf* bufs[], uint32_t num_bufs);
+void pkt_buf_free_seg(struct pkt_buf* buf);
+void pkt_buf_free_seg_batch(struct pkt_buf* bufs[], uint32_t num_bufs);
+struct recycle_ring* recycle_ring_create(struct mempool* mempool, uint32_t size);
+uint32_t recycle_ring_get(struct recycle_ring* ring, struct pkt_buf* bufs[], uint32_t num_bufs);
+void pkt_buf_recycle_seg_batch(struct recycle_ring* ring, struct pkt_buf* bufs[], uint32_t num_bufs);
+void pkt_buf_append_seg(struct pkt_buf* head, struct pkt_buf* tail, struct pkt_buf* seg);
 
 #endif //IXY_MEMORY_H
@@ -2,7 +2,10 @@
 #include <errno.h>
 #include <linux/limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
+#include <sys/io.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,11 +44,16 @@ void enable_dma(const char* pci_addr) {
 }
 
 uint8_t* pci_map_resource(const char* pci_addr) {
-	char path[PATH_MAX];
-	snprintf(path, PATH_MAX, "/sys/bus/pci/devices/%s/resource0", pci_addr);
-	debug("Mapping PCI resource at %s", path);
 	remove_driver(pci_addr);
 	enable_dma(pci_addr);
+	return pci_map_bar(pci_addr, 0);
+}
+
+// maps a memory bar without touching the driver binding or bus mastering, the caller takes care of that
+uint8_t* pci_map_bar(const char* pci_addr, int bar) {
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "/sys/bus/pci/devices/%s/resource%d", pci_addr, bar);
+	debug("Mapping PCI resource at %s", path);
 	int fd = check_err(open(path, O_RDWR), "open pci resource");
 	struct stat stat;
 	check_err(fstat(fd, &stat), "stat pci resource");
@@ -59,3 +67,71 @@ int pci_open_resource(const char* pci_addr, const char* resource) {
 	int fd = check_err(open(path, O_RDWR), "open pci resource");
 	return fd;
 }
+
+// NUMA node the device is attached to, NUMA_NODE_ANY (-1) if unknown or not a NUMA system
+int pci_get_numa_node(const char* pci_addr) {
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "/sys/bus/pci/devices/%s/numa_node", pci_addr);
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		debug("no numa_node for device %s", pci_addr);
+		return -1;
+	}
+	int node = -1;
+	if (fscanf(file, "%d", &node) != 1) {
+		node = -1;
+	}
+	fclose(file);
+	return node;
+}
+
+// direct access to the io ports of a bar (legacy virtio) with in/out instructions instead of a syscall per access
+// returns the base port or 0 if the bar isn't an io bar or if we lack the privileges (CAP_SYS_RAWIO, IXY_ALLOW_IOPL)
+// callers fall back to pci_open_resource and read_io/write_io in that case
+uint16_t pci_enable_ioports(const char* pci_addr, int bar) {
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "/sys/bus/pci/devices/%s/resource", pci_addr);
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		debug("no resource list for device %s", pci_addr);
+		return 0;
+	}
+	// one line per bar: start, end, flags
+	unsigned long long start = 0, end = 0, flags = 0;
+	int found = 0;
+	for (int i = 0; i <= bar; i++) {
+		found = fscanf(file, "%llx %llx %llx", &start, &end, &flags) == 3;
+		if (!found) {
+			break;
+		}
+	}
+	fclose(file);
+	// 0x100 is IORESOURCE_IO from linux/ioport.h
+	if (!found || !(flags & 0x100) || !start || end > 0xFFFF) {
+		debug("resource%d of device %s is not an io port bar", bar, pci_addr);
+		return 0;
+	}
+	// ioperm only covers the first 0x400 ports, everything above needs iopl
+	// iopl(3) grants access to every port of the machine, not just the ones of this device, so it's opt-in
+	int ret;
+	if (end < 0x400) {
+		ret = ioperm(start, end - start + 1, 1);
+	} else {
+		const char* allow_iopl = getenv("IXY_ALLOW_IOPL");
+		if (!allow_iopl || strcmp(allow_iopl, "1")) {
+			info("io ports 0x%04llX-0x%04llX of %s need iopl(3) which unlocks all ports, set IXY_ALLOW_IOPL=1 to allow it, "
+				"using the sysfs resource instead", start, end, pci_addr);
+			return 0;
+		}
+		ret = iopl(3);
+		if (!ret) {
+			warn("iopl(3): this process can now access all io ports of the machine, not only 0x%04llX-0x%04llX", start, end);
+		}
+	}
+	if (ret) {
+		info("no permission for direct port io (%s), using the sysfs resource of %s instead", strerror(errno), pci_addr);
+		return 0;
+	}
+	debug("using io ports 0x%04llX-0x%04llX of device %s", start, end, pci_addr);
+	return (uint16_t) start;
+}
@@ -6,6 +6,9 @@
 void remove_driver(const char* pci_addr);
 void enable_dma(const char* pci_addr);
 uint8_t* pci_map_resource(const char* bus_id);
+uint8_t* pci_map_bar(const char* pci_addr, int bar);
 int pci_open_resource(const char* pci_addr, const char* resource);
+int pci_get_numa_node(const char* pci_addr);
+uint16_t pci_enable_ioports(const char* pci_addr, int bar);
 
 #endif // IXY_PCI_H
@@ -27,6 +27,14 @@ void print_stats_diff(struct device_stats* stats_new, struct device_stats* stats
 		diff_mbit(stats_new->tx_bytes, stats_old->tx_bytes, stats_new->tx_pkts, stats_old->tx_pkts, nanos),
 		diff_mpps(stats_new->tx_pkts, stats_old->tx_pkts, nanos)
 	);
+	if (stats_new->rx_refill_deferred != stats_old->rx_refill_deferred) {
+		printf("[%s] RX: mempool empty, %zu refills deferred\n", stats_new->device ? stats_new->device->pci_addr : "???",
+			stats_new->rx_refill_deferred - stats_old->rx_refill_deferred);
+	}
+	if (stats_new->filter_hits != stats_old->filter_hits || stats_new->filter_misses != stats_old->filter_misses) {
+		printf("[%s] RX: flow filters matched %zu packets, missed %zu\n", stats_new->device ? stats_new->device->pci_addr : "???",
+			stats_new->filter_hits - stats_old->filter_hits, stats_new->filter_misses - stats_old->filter_misses);
+	}
 }
 
 
@@ -45,6 +53,9 @@ void stats_init(struct device_stats* stats, struct ixy_device* dev) {
 	stats->tx_pkts = 0;
 	stats->rx_bytes = 0;
 	stats->tx_bytes = 0;
+	stats->rx_refill_deferred = 0;
+	stats->filter_hits = 0;
+	stats->filter_misses = 0;
 	stats->device = dev;
 	if (dev) {
 		ixy_read_stats(dev, NULL);
@@ -12,6 +12,11 @@ struct device_stats {
 	size_t tx_pkts;
 	size_t rx_bytes;
 	size_t tx_bytes;
+	// number of times rx descriptors couldn't be refilled because the mempool was empty
+	size_t rx_refill_deferred;
+	// received packets that did (not) match a flow filter, only counted while filters are in use
+	size_t filter_hits;
+	size_t filter_misses;
 };
 
 
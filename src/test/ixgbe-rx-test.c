@@ -0,0 +1,237 @@
+// checks the vector rx path against the scalar one
+// a fake nic writes back descriptors into a ring in memory, no hardware (but huge pages for the mempool) needed
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the test works on the queue internals of the driver
+#include "driver/ixgbe.c"
+#include "test-common.h"
+
+// small ring and mempool: many wrap-arounds and the mempool runs dry while the app holds on to bufs
+#define RING_SIZE 64
+#define POOL_SIZE (RING_SIZE + 48)
+// test a queue other than 0 to catch queue addressing bugs
+#define QUEUE_ID 1
+#define NUM_PKTS 50000
+#define MAX_SEGS 3
+#define MAX_HELD 40
+
+// packet as sent by the fake nic
+struct test_pkt {
+	uint16_t num_segs;
+	uint16_t seg_len[MAX_SEGS];
+	uint32_t status; // without DD and EOP
+	uint16_t pkt_info;
+	uint32_t rss;
+	uint16_t vlan;
+};
+
+// what the driver returned, only fields that are valid according to the flags
+struct rx_result {
+	uint16_t nb_segs;
+	uint32_t pkt_len;
+	uint8_t port;
+	uint8_t ol_flags;
+	uint16_t queue;
+	uint16_t packet_type;
+	uint32_t rss_hash;
+	uint16_t vlan_tci;
+};
+
+static struct test_pkt pkts[NUM_PKTS];
+static struct rx_result results[2][NUM_PKTS];
+
+static void generate_pkts() {
+	const uint32_t status_bits[] = {
+		IXGBE_RXDADV_STAT_VP, IXGBE_RXD_STAT_IPCS, IXGBE_RXD_STAT_L4CS, IXGBE_RXDADV_ERR_IPE, IXGBE_RXDADV_ERR_TCPE
+	};
+	for (int i = 0; i < NUM_PKTS; i++) {
+		struct test_pkt* pkt = &pkts[i];
+		// every 8th packet is a chain (jumbo frame), these end up in the middle of groups of four descriptors
+		pkt->num_segs = next_rand() % 8 ? 1 : 2 + next_rand() % (MAX_SEGS - 1);
+		for (int seg = 0; seg < pkt->num_segs; seg++) {
+			pkt->seg_len[seg] = seg == pkt->num_segs - 1 ? 60 + next_rand() % 1455 : RX_BUF_SIZE_JUMBO;
+		}
+		pkt->status = 0;
+		for (size_t bit = 0; bit < sizeof(status_bits) / sizeof(*status_bits); bit++) {
+			pkt->status |= next_rand() % 2 ? status_bits[bit] : 0;
+		}
+		pkt->pkt_info = (uint16_t) next_rand();
+		pkt->rss = next_rand();
+		pkt->vlan = (uint16_t) next_rand();
+	}
+}
+
+// the fake nic owns the descriptors from its head up to (excluding) RDT
+struct fake_nic {
+	uint16_t head;
+	uint32_t pkt;
+	uint16_t seg;
+	// address of each written segment in the order of writing, checked against the bufs returned by the driver
+	uintptr_t seg_addrs[NUM_PKTS * MAX_SEGS];
+	uint32_t num_seg_addrs;
+};
+
+static void nic_receive(struct ixgbe_device* dev, struct ixgbe_rx_queue* queue, struct fake_nic* nic, uint32_t num_descs) {
+	uint16_t rdt = get_reg32(dev->addr, IXGBE_RDT(QUEUE_ID));
+	while (num_descs-- && nic->head != rdt && nic->pkt < NUM_PKTS) {
+		volatile union ixgbe_adv_rx_desc* desc_ptr = queue->descriptors + nic->head;
+		// refilled descriptors have their flags (hdr_addr) cleared
+		if (desc_ptr->read.hdr_addr || !desc_ptr->read.pkt_addr) {
+			error("nic got descriptor %u without a new buf", nic->head);
+		}
+		nic->seg_addrs[nic->num_seg_addrs++] = desc_ptr->read.pkt_addr;
+		struct test_pkt* pkt = &pkts[nic->pkt];
+		bool eop = nic->seg == pkt->num_segs - 1;
+		union ixgbe_adv_rx_desc desc = {};
+		desc.wb.lower.lo_dword.hs_rss.pkt_info = pkt->pkt_info;
+		desc.wb.lower.hi_dword.rss = pkt->rss;
+		desc.wb.upper.status_error = IXGBE_RXDADV_STAT_DD | (eop ? IXGBE_RXDADV_STAT_EOP | pkt->status : 0);
+		desc.wb.upper.length = pkt->seg_len[nic->seg];
+		desc.wb.upper.vlan = pkt->vlan;
+		*desc_ptr = desc;
+		if (eop) {
+			nic->pkt++;
+			nic->seg = 0;
+		} else {
+			nic->seg++;
+		}
+		nic->head = (nic->head + 1) & (RING_SIZE - 1);
+	}
+}
+
+static struct ixgbe_device* create_device(struct mempool* mempool) {
+	struct ixgbe_device* dev = calloc(1, sizeof(*dev));
+	dev->ixy.num_rx_queues = QUEUE_ID + 1;
+	dev->ixy.port_id = 3;
+	dev->addr = calloc(1, 0x20000);
+	dev->rx_queues = calloc(QUEUE_ID + 1, sizeof(struct ixgbe_rx_queue) + sizeof(void*) * MAX_RX_QUEUE_ENTRIES);
+	// the other queues must not be touched, checked at the end of run
+	set_queue_guards(dev, true, QUEUE_ID);
+	struct ixgbe_rx_queue* queue = get_rx_queue(dev, QUEUE_ID);
+	queue->num_entries = RING_SIZE;
+	queue->mempool = mempool;
+	queue->descriptors = aligned_alloc(64, RING_SIZE * sizeof(union ixgbe_adv_rx_desc));
+	// same as start_rx_queue: all descriptors get a buf, the queue starts out full
+	for (int i = 0; i < RING_SIZE; i++) {
+		struct pkt_buf* buf = pkt_buf_alloc(mempool);
+		queue->descriptors[i].read.pkt_addr = buf->buf_addr_phy + offsetof(struct pkt_buf, data);
+		queue->descriptors[i].read.hdr_addr = 0;
+		queue->virtual_addresses[i] = buf;
+	}
+	set_reg32(dev->addr, IXGBE_RDT(QUEUE_ID), RING_SIZE - 1);
+	return dev;
+}
+
+static void check_pkt(struct fake_nic* nic, uint32_t* seg_idx, uint32_t pkt_idx, struct pkt_buf* buf, struct rx_result* result) {
+	struct test_pkt* pkt = &pkts[pkt_idx];
+	if (buf->nb_segs != pkt->num_segs) {
+		error("packet %u: got %u segments, expected %u", pkt_idx, buf->nb_segs, pkt->num_segs);
+	}
+	uint32_t pkt_len = 0;
+	int i = 0;
+	for (struct pkt_buf* seg = buf; seg; seg = seg->next, i++) {
+		if (seg->buf_addr_phy + offsetof(struct pkt_buf, data) != nic->seg_addrs[(*seg_idx)++]) {
+			error("packet %u: segment %d is not the buf the nic wrote to", pkt_idx, i);
+		}
+		if (seg->size != pkt->seg_len[i]) {
+			error("packet %u: segment %d has size %u, expected %u", pkt_idx, i, seg->size, pkt->seg_len[i]);
+		}
+		pkt_len += seg->size;
+	}
+	if (buf->pkt_len != pkt_len) {
+		error("packet %u: pkt_len %u, expected %u", pkt_idx, buf->pkt_len, pkt_len);
+	}
+	struct pkt_buf_meta* meta = &buf->meta;
+	if ((meta->ol_flags & PKT_RX_RSS_HASH) && meta->rss_hash != pkt->rss) {
+		error("packet %u: rss hash 0x%08X, expected 0x%08X", pkt_idx, meta->rss_hash, pkt->rss);
+	}
+	if ((meta->ol_flags & PKT_RX_VLAN) && meta->vlan_tci != pkt->vlan) {
+		error("packet %u: vlan tci 0x%04X, expected 0x%04X", pkt_idx, meta->vlan_tci, pkt->vlan);
+	}
+	if (meta->queue != QUEUE_ID || meta->port != 3) {
+		error("packet %u: received on port %u queue %u", pkt_idx, meta->port, meta->queue);
+	}
+	result->nb_segs = buf->nb_segs;
+	result->pkt_len = buf->pkt_len;
+	result->port = meta->port;
+	result->ol_flags = meta->ol_flags;
+	result->queue = meta->queue;
+	result->packet_type = meta->packet_type;
+	result->rss_hash = meta->ol_flags & PKT_RX_RSS_HASH ? meta->rss_hash : 0;
+	result->vlan_tci = meta->ol_flags & PKT_RX_VLAN ? meta->vlan_tci : 0;
+}
+
+static void run(bool vec, struct rx_result* results) {
+	rand_state = 0x1234567;
+	struct mempool* mempool = memory_allocate_mempool(POOL_SIZE, 2048);
+	struct ixgbe_device* dev = create_device(mempool);
+	struct ixgbe_rx_queue* queue = get_rx_queue(dev, QUEUE_ID);
+	struct fake_nic* nic = calloc(1, sizeof(*nic));
+	uint32_t seg_idx = 0;
+	uint32_t num_rx = 0;
+	// packets held by the app, freed in order
+	struct pkt_buf* held[MAX_HELD + 64];
+	uint32_t num_held = 0;
+	uint32_t iterations = 0;
+	while (num_rx < NUM_PKTS) {
+		if (++iterations > NUM_PKTS * 10) {
+			error("no progress, %u packets received", num_rx);
+		}
+		// bursts end anywhere: in the middle of a group of four descriptors or in the middle of a chain
+		nic_receive(dev, queue, nic, next_rand() % 48);
+		struct pkt_buf* bufs[64];
+		uint32_t num_bufs = 1 + next_rand() % 63;
+		uint32_t num = vec ? ixgbe_rx_batch_vec(&dev->ixy, QUEUE_ID, bufs, num_bufs) : ixgbe_rx_batch(&dev->ixy, QUEUE_ID, bufs, num_bufs);
+		if (num > num_bufs || num_rx + num > nic->pkt) {
+			error("got %u packets for a batch of %u, nic sent %u, received before %u", num, num_bufs, nic->pkt, num_rx);
+		}
+		for (uint32_t i = 0; i < num; i++) {
+			check_pkt(nic, &seg_idx, num_rx, bufs[i], &results[num_rx]);
+			num_rx++;
+			held[num_held++] = bufs[i];
+		}
+		// the app holds on to some bufs, this makes the refill run out of bufs every now and then
+		if (num_held > MAX_HELD || next_rand() % 4 == 0) {
+			uint32_t num_free = num_held > MAX_HELD ? num_held : next_rand() % (num_held + 1);
+			pkt_buf_free_batch(held, num_free);
+			memmove(held, held + num_free, (num_held - num_free) * sizeof(*held));
+			num_held -= num_free;
+		}
+	}
+	pkt_buf_free_batch(held, num_held);
+	if (queue->pkt_head) {
+		error("incomplete packet left in the queue");
+	}
+	check_queue_guards(dev, true, QUEUE_ID);
+	// all bufs are either free or in one of the descriptors that were refilled
+	uint32_t pending = (queue->rx_index - queue->refill_index) & (RING_SIZE - 1);
+	uint32_t num_free = count_free_bufs(mempool);
+	if (num_free != POOL_SIZE - (RING_SIZE - pending)) {
+		error("leaked bufs: %u free, %u in the ring, pool size %u", num_free, RING_SIZE - pending, POOL_SIZE);
+	}
+	if (!queue->refill_deferred) {
+		error("mempool never ran dry, the deferred refill was not tested");
+	}
+	info("%s rx path: %u packets in %u iterations, refill deferred %u times",
+		vec ? "vector" : "scalar", num_rx, iterations, queue->refill_deferred);
+}
+
+int main() {
+	if (!__builtin_cpu_supports("sse4.1")) {
+		info("cpu doesn't support SSE4.1, skipping test");
+		return 0;
+	}
+	rand_state = 42;
+	generate_pkts();
+	run(false, results[0]);
+	run(true, results[1]);
+	for (uint32_t i = 0; i < NUM_PKTS; i++) {
+		if (memcmp(&results[0][i], &results[1][i], sizeof(struct rx_result))) {
+			error("packet %u differs between the scalar and the vector rx path", i);
+		}
+	}
+	info("scalar and vector rx path returned the same %u packets", NUM_PKTS);
+	return 0;
+}
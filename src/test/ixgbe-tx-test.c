@@ -0,0 +1,187 @@
+// checks the tx path: descriptor contents, sparse RS flags, and cleanup with and without head write-back
+// a fake nic reads the descriptors from a ring in memory, no hardware (but huge pages for the mempool) needed
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the test works on the queue internals of the driver
+#include "driver/ixgbe.c"
+#include "test-common.h"
+
+// small ring: many wrap-arounds, packets regularly don't fit and have to wait for the cleanup
+#define RING_SIZE 128
+#define POOL_SIZE 1024
+// test a queue other than 0 to catch queue addressing bugs
+#define QUEUE_ID 1
+#define NUM_ITERATIONS 100000
+#define MAX_SEGS 4
+
+// a descriptor as we expect the nic to see it
+struct expected_desc {
+	uintptr_t addr;
+	uint16_t len;
+	uint32_t pkt_len;
+	bool eop;
+};
+
+// the fake nic processes the descriptors from its head up to (excluding) TDT
+struct fake_nic {
+	uint16_t head;
+	// segments queued by the driver in the order they were sent, indices are free-running
+	struct expected_desc expected[RING_SIZE];
+	uint32_t expected_head;
+	uint32_t expected_tail;
+	// ends (index after the descriptor) of processed descriptors with RS, the only positions the cleanup may stop at
+	uint16_t rs_ends[RING_SIZE];
+	uint32_t rs_head;
+	uint32_t rs_tail;
+	uint64_t num_descs;
+	uint64_t num_rs;
+};
+
+static void nic_transmit(struct ixgbe_device* dev, struct ixgbe_tx_queue* queue, struct fake_nic* nic, uint32_t num_descs) {
+	uint16_t tdt = get_reg32(dev->addr, IXGBE_TDT(QUEUE_ID));
+	while (num_descs-- && nic->head != tdt) {
+		volatile union ixgbe_adv_tx_desc* desc = queue->descriptors + nic->head;
+		if (nic->expected_head == nic->expected_tail) {
+			error("descriptor %u was not sent by the driver", nic->head);
+		}
+		struct expected_desc* exp = &nic->expected[nic->expected_head++ % RING_SIZE];
+		uint32_t cmd_type_len = desc->read.cmd_type_len;
+		uint32_t expected_cmd = IXGBE_ADVTXD_DCMD_IFCS | IXGBE_ADVTXD_DCMD_DEXT | IXGBE_ADVTXD_DTYP_DATA | exp->len
+			| (exp->eop ? IXGBE_ADVTXD_DCMD_EOP : 0);
+		if (desc->read.buffer_addr != exp->addr || (cmd_type_len & ~IXGBE_ADVTXD_DCMD_RS) != expected_cmd
+				|| desc->read.olinfo_status != exp->pkt_len << IXGBE_ADVTXD_PAYLEN_SHIFT) {
+			error("descriptor %u: addr 0x%lX cmd 0x%08X olinfo 0x%08X, expected addr 0x%lX cmd 0x%08X olinfo 0x%08X",
+				nic->head, desc->read.buffer_addr, cmd_type_len, desc->read.olinfo_status,
+				exp->addr, expected_cmd, exp->pkt_len << IXGBE_ADVTXD_PAYLEN_SHIFT);
+		}
+		nic->head = (nic->head + 1) & (RING_SIZE - 1);
+		nic->num_descs++;
+		if (cmd_type_len & IXGBE_ADVTXD_DCMD_RS) {
+			// the cleanup must not free a packet while the nic still uses parts of it
+			if (!(cmd_type_len & IXGBE_ADVTXD_DCMD_EOP)) {
+				error("RS on descriptor %u without EOP", (nic->head - 1) & (RING_SIZE - 1));
+			}
+			nic->rs_ends[nic->rs_tail++ % RING_SIZE] = nic->head;
+			nic->num_rs++;
+			// status is only written back for descriptors with RS, either in the descriptor or as the head index
+			if (queue->head_wb) {
+				*queue->head_wb = nic->head;
+			} else {
+				desc->wb.status = IXGBE_ADVTXD_STAT_DD;
+			}
+		}
+	}
+}
+
+static struct ixgbe_device* create_device(bool head_wb) {
+	struct ixgbe_device* dev = calloc(1, sizeof(*dev));
+	dev->ixy.num_tx_queues = QUEUE_ID + 1;
+	dev->addr = calloc(1, 0x20000);
+	dev->tx_queues = calloc(QUEUE_ID + 1, sizeof(struct ixgbe_tx_queue) + sizeof(void*) * MAX_TX_QUEUE_ENTRIES);
+	// the other queues must not be touched, checked at the end of run
+	set_queue_guards(dev, false, QUEUE_ID);
+	struct ixgbe_tx_queue* queue = get_tx_queue(dev, QUEUE_ID);
+	queue->num_entries = RING_SIZE;
+	queue->descriptors = aligned_alloc(64, RING_SIZE * sizeof(union ixgbe_adv_tx_desc));
+	memset((void*) queue->descriptors, 0, RING_SIZE * sizeof(union ixgbe_adv_tx_desc));
+	if (head_wb) {
+		queue->head_wb = calloc(1, sizeof(uint32_t));
+	}
+	return dev;
+}
+
+static struct pkt_buf* create_pkt(struct mempool* mempool) {
+	// every 8th packet is a chain, these go through the slow path and break up groups of four
+	uint32_t num_segs = next_rand() % 8 ? 1 : 2 + next_rand() % (MAX_SEGS - 1);
+	struct pkt_buf* head = pkt_buf_alloc(mempool);
+	if (!head) {
+		error("mempool empty, bufs leaked");
+	}
+	head->size = 60 + next_rand() % 1455;
+	head->pkt_len = head->size;
+	struct pkt_buf* tail = head;
+	for (uint32_t i = 1; i < num_segs; i++) {
+		struct pkt_buf* seg = pkt_buf_alloc(mempool);
+		if (!seg) {
+			error("mempool empty, bufs leaked");
+		}
+		seg->size = 60 + next_rand() % 1455;
+		pkt_buf_append_seg(head, tail, seg);
+		tail = seg;
+	}
+	return head;
+}
+
+// the cleanup may only move to the end of a descriptor with RS that the nic already processed
+static void check_clean_index(struct ixgbe_tx_queue* queue, struct fake_nic* nic, uint16_t old_clean_index) {
+	if (queue->clean_index == old_clean_index) {
+		return;
+	}
+	while (nic->rs_head != nic->rs_tail && nic->rs_ends[nic->rs_head % RING_SIZE] != queue->clean_index) {
+		nic->rs_head++;
+	}
+	if (nic->rs_head == nic->rs_tail) {
+		error("cleaned up to %u, that's not the end of a processed descriptor with RS", queue->clean_index);
+	}
+	nic->rs_head++;
+}
+
+static void run(bool head_wb) {
+	struct mempool* mempool = memory_allocate_mempool(POOL_SIZE, 2048);
+	struct ixgbe_device* dev = create_device(head_wb);
+	struct ixgbe_tx_queue* queue = get_tx_queue(dev, QUEUE_ID);
+	struct fake_nic* nic = calloc(1, sizeof(*nic));
+	uint64_t num_tx = 0;
+	for (uint32_t iteration = 0; iteration < NUM_ITERATIONS; iteration++) {
+		struct pkt_buf* bufs[64];
+		uint32_t num_bufs = next_rand() % 64;
+		for (uint32_t i = 0; i < num_bufs; i++) {
+			bufs[i] = create_pkt(mempool);
+		}
+		uint16_t clean_index = queue->clean_index;
+		uint32_t sent = ixgbe_tx_batch(&dev->ixy, QUEUE_ID, bufs, num_bufs);
+		check_clean_index(queue, nic, clean_index);
+		if (sent > num_bufs) {
+			error("sent %u of %u packets", sent, num_bufs);
+		}
+		for (uint32_t i = 0; i < sent; i++) {
+			for (struct pkt_buf* seg = bufs[i]; seg; seg = seg->next) {
+				struct expected_desc* exp = &nic->expected[nic->expected_tail++ % RING_SIZE];
+				exp->addr = seg->buf_addr_phy + offsetof(struct pkt_buf, data);
+				exp->len = seg->size;
+				exp->pkt_len = bufs[i]->pkt_len;
+				exp->eop = !seg->next;
+			}
+		}
+		num_tx += sent;
+		pkt_buf_free_batch(bufs + sent, num_bufs - sent);
+		// the nic is sometimes slower than us, the queue fills up
+		if (next_rand() % 3) {
+			nic_transmit(dev, queue, nic, next_rand() % 128);
+		}
+	}
+	// everything is sent, the cleanup must get all bufs back except for the last incomplete clean batch
+	nic_transmit(dev, queue, nic, RING_SIZE);
+	uint16_t clean_index = queue->clean_index;
+	ixgbe_tx_batch(&dev->ixy, QUEUE_ID, NULL, 0);
+	check_clean_index(queue, nic, clean_index);
+	uint32_t in_use = (queue->tx_index - queue->clean_index) & (RING_SIZE - 1);
+	if (in_use >= (head_wb ? 1 : TX_CLEAN_BATCH + MAX_SEGS)) {
+		error("%u descriptors still in use after the nic sent everything", in_use);
+	}
+	uint32_t num_free = count_free_bufs(mempool);
+	if (num_free != POOL_SIZE - in_use) {
+		error("leaked bufs: %u free, %u in the ring, pool size %u", num_free, in_use, POOL_SIZE);
+	}
+	check_queue_guards(dev, false, QUEUE_ID);
+	info("%s: %lu packets in %lu descriptors, RS set on %lu", head_wb ? "head write-back" : "descriptor write-back",
+		num_tx, nic->num_descs, nic->num_rs);
+}
+
+int main() {
+	run(false);
+	run(true);
+	return 0;
+}
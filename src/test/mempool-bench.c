@@ -0,0 +1,98 @@
+// multi-threaded alloc/free benchmark of the mempool: per-thread caches vs. all threads on the shared ring
+// usage: mempool-bench [seconds per run], each run starts new threads, so thread ids are released and reused
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "memory.h"
+
+#define BATCH_SIZE 32
+#define MAX_THREADS 16
+
+struct bench_thread {
+	pthread_t thread;
+	struct mempool* mempool;
+	double seconds;
+	uint64_t ops;
+};
+
+static double monotonic_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// like a forwarding thread: allocate a batch, free it again
+static void* bench_thread(void* arg) {
+	struct bench_thread* thread = arg;
+	struct pkt_buf* bufs[BATCH_SIZE];
+	uint64_t ops = 0;
+	double end = monotonic_time() + thread->seconds;
+	do {
+		for (int i = 0; i < 64; i++) {
+			uint32_t num = pkt_buf_alloc_batch(thread->mempool, bufs, BATCH_SIZE);
+			pkt_buf_free_batch(bufs, num);
+			ops += num;
+		}
+	} while (monotonic_time() < end);
+	thread->ops = ops;
+	mempool_cache_flush(thread->mempool);
+	return NULL;
+}
+
+static void run(struct mempool* mempool, uint32_t num_threads, double seconds, bool caches) {
+	uint32_t cache_size = mempool->cache_size;
+	if (!caches) {
+		// same as a pool that is too small for caches
+		mempool->cache_size = 0;
+	}
+	struct bench_thread threads[MAX_THREADS];
+	for (uint32_t i = 0; i < num_threads; i++) {
+		threads[i].mempool = mempool;
+		threads[i].seconds = seconds;
+		if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i])) {
+			error("failed to create thread");
+		}
+	}
+	uint64_t ops = 0;
+	for (uint32_t i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		ops += threads[i].ops;
+	}
+	mempool->cache_size = cache_size;
+	// all threads flushed their caches before exiting
+	struct mempool_stats stats;
+	mempool_read_stats(mempool, &stats);
+	if (stats.num_free != mempool->num_entries) {
+		error("%u of %u bufs free after the threads exited", stats.num_free, mempool->num_entries);
+	}
+	if (seconds > 0) {
+		printf("%-12s %2u threads: %8.2f Mbufs/s alloc+free\n", caches ? "caches" : "shared ring", num_threads, ops / seconds / 1e6);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	double seconds = argc > 1 ? atof(argv[1]) : 1;
+	// more threads than cores only measure the scheduler: a preempted thread blocks the ring for everyone
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t max_threads = num_cpus < MAX_THREADS ? num_cpus : MAX_THREADS;
+	struct mempool* mempool = memory_allocate_mempool(MAX_THREADS * 1024, 2048);
+	for (uint32_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+		run(mempool, num_threads, seconds, false);
+		run(mempool, num_threads, seconds, true);
+	}
+	// more than MEMPOOL_MAX_THREADS short-lived threads, the last ones must still get a cache
+	for (uint32_t i = 0; i < MEMPOOL_MAX_THREADS * 2; i++) {
+		struct mempool_stats before, after;
+		mempool_read_stats(mempool, &before);
+		run(mempool, 1, 0, true);
+		mempool_read_stats(mempool, &after);
+		if (after.cache_hits == before.cache_hits) {
+			error("no cache hits in thread %u, thread ids are not reused", i);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,79 @@
+// compares the two ways to notify a legacy virtio device: pwrite on the sysfs resource vs. direct port i/o (outw)
+// usage: notify-bench [pci address of a legacy virtio device] [number of notifications]
+// the device must be bound to no driver or to the kernel driver, we notify queue 0xFFFF which doesn't exist and is
+// ignored by the device (QEMU drops notifications for indices >= VIRTIO_QUEUE_MAX), but still costs a full vm exit
+// without a device: pwrite on /dev/null vs. outb to the POST diagnostic port 0x80, i.e., the syscall vs. the instruction
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/io.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "pci.h"
+#include "driver/device.h"
+#include "driver/virtio_type.h"
+
+#define NO_QUEUE 0xFFFF
+#define POST_PORT 0x80
+
+static double monotonic_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_result(const char* name, double start, uint32_t num) {
+	printf("%-30s %8.0f ns per notification\n", name, (monotonic_time() - start) / num * 1e9);
+}
+
+static void bench_device(const char* pci_addr, uint32_t num) {
+	int fd = pci_open_resource(pci_addr, "resource0");
+	double start = monotonic_time();
+	for (uint32_t i = 0; i < num; i++) {
+		write_io16(fd, NO_QUEUE, VIRTIO_PCI_QUEUE_NOTIFY);
+	}
+	print_result("pwrite on sysfs resource", start, num);
+	close(fd);
+	uint16_t port = pci_enable_ioports(pci_addr, 0);
+	if (!port) {
+		info("no direct port i/o, skipping outw");
+		return;
+	}
+	start = monotonic_time();
+	for (uint32_t i = 0; i < num; i++) {
+		write_port16(port, NO_QUEUE, VIRTIO_PCI_QUEUE_NOTIFY);
+	}
+	print_result("outw", start, num);
+}
+
+static void bench_no_device(uint32_t num) {
+	int fd = check_err(open("/dev/null", O_WRONLY), "open /dev/null");
+	double start = monotonic_time();
+	for (uint32_t i = 0; i < num; i++) {
+		write_io16(fd, NO_QUEUE, 0);
+	}
+	print_result("pwrite on /dev/null", start, num);
+	close(fd);
+	if (ioperm(POST_PORT, 1, 1)) {
+		info("no permission for port 0x%X (CAP_SYS_RAWIO), skipping outb", POST_PORT);
+		return;
+	}
+	start = monotonic_time();
+	for (uint32_t i = 0; i < num; i++) {
+		write_port8(POST_PORT, 0, 0);
+	}
+	print_result("outb to port 0x80", start, num);
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t num = argc > 2 ? atoi(argv[2]) : 100000;
+	if (argc > 1) {
+		bench_device(argv[1], num);
+	} else {
+		info("no device given, measuring the syscall and port i/o overhead without a device");
+		bench_no_device(num);
+	}
+	return 0;
+}
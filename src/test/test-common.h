@@ -0,0 +1,54 @@
+#ifndef IXY_TEST_COMMON_H
+#define IXY_TEST_COMMON_H
+
+// helpers shared by the driver tests, include after the driver source
+#include <stdbool.h>
+#include <stdint.h>
+
+// deterministic random numbers, tests reset the state to replay the same sequence
+static uint64_t rand_state = 42;
+
+static uint32_t next_rand() {
+	// xorshift64
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return (uint32_t) rand_state;
+}
+
+static uint32_t count_free_bufs(struct mempool* mempool) {
+	// one at a time: bufs in the per-thread cache are free as well
+	uint32_t num_free = 0;
+	while (pkt_buf_alloc(mempool)) {
+		num_free++;
+	}
+	return num_free;
+}
+
+#ifdef IXY_IXGBE_H
+// written into the queues that a test must not touch
+#define QUEUE_GUARD 0xBEEF
+
+// the queues in front of the tested one catch queue addressing bugs, see check_queue_guards
+static void set_queue_guards(struct ixgbe_device* dev, bool rx, uint16_t queue_id) {
+	for (uint16_t i = 0; i < queue_id; i++) {
+		if (rx) {
+			get_rx_queue(dev, i)->num_entries = QUEUE_GUARD;
+		} else {
+			get_tx_queue(dev, i)->num_entries = QUEUE_GUARD;
+		}
+	}
+}
+
+static void check_queue_guards(struct ixgbe_device* dev, bool rx, uint16_t queue_id) {
+	for (uint16_t i = 0; i < queue_id; i++) {
+		uint16_t num_entries = rx ? get_rx_queue(dev, i)->num_entries : get_tx_queue(dev, i)->num_entries;
+		if (num_entries != QUEUE_GUARD) {
+			error("%s queue %u was overwritten", rx ? "rx" : "tx", i);
+		}
+	}
+}
+
+#endif // IXY_IXGBE_H
+
+#endif // IXY_TEST_COMMON_H
@@ -0,0 +1,153 @@
+// checks the notifications with event indices (VIRTIO_RING_F_EVENT_IDX) on a virtqueue in memory
+// the driver must kick exactly when the avail index passes the avail event, also when the 16 bit indices wrap around
+// a fake device consumes the tx ring, no hardware (but huge pages for the mempool) needed
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the test works on the queue internals of the driver
+#include "driver/virtio.c"
+#include "test-common.h"
+
+#define RING_SIZE 256
+#define POOL_SIZE 1024
+#define NUM_ITERATIONS 100000
+// close to the wrap-around of the 16 bit indices
+#define START_IDX 0xFFF0
+// written into the doorbell before each batch, the driver writes the queue index (1 for tx) on a kick
+#define NO_KICK 0xFFFF
+
+// the device sees the same avail/used indices as the driver, everything else is the driver's business
+struct fake_device {
+	uint16_t last_avail_idx;
+	uint16_t used_idx;
+	uint64_t num_kicks;
+	uint64_t num_suppressed;
+};
+
+// a modern device: the doorbell is a plain memory location that we can check after each call
+static struct virtio_device* create_device() {
+	struct virtio_device* dev = calloc(1, sizeof(*dev));
+	dev->modern = true;
+	dev->event_idx = true;
+	dev->net_hdr_len = sizeof(struct virtio_legacy_net_hdr_mrg_rxbuf);
+	dev->notify_base = calloc(1, 64);
+	struct virtqueue* vq = calloc(1, sizeof(*vq) + sizeof(void*) * RING_SIZE);
+	size_t ring_size = virtio_vring_size(RING_SIZE, VIRTIO_PCI_VRING_ALIGN);
+	void* ring = aligned_alloc(VIRTIO_PCI_VRING_ALIGN, ring_size);
+	memset(ring, 0, ring_size);
+	// same as virtio_setup_tx_queue
+	virtio_vring_init(&vq->vring, RING_SIZE, ring, VIRTIO_PCI_VRING_ALIGN);
+	for (uint16_t i = 0; i < RING_SIZE; i++) {
+		vq->vring.desc[i].next = i + 1;
+	}
+	vq->free_head = 0;
+	vq->num_free = RING_SIZE;
+	vq->vring.avail->idx = START_IDX;
+	vq->vring.used->idx = START_IDX;
+	vq->vq_used_last_idx = START_IDX;
+	vq->vring.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	virtio_suppress_interrupts(vq);
+	dev->tx_queue = vq;
+	return dev;
+}
+
+// the device's view, written independently of vring_need_event: the index moved over the event if the event is one
+// of the indices that were added, i.e., in [old, new)
+static bool event_passed(uint16_t event, uint16_t old_idx, uint16_t new_idx) {
+	return (uint16_t) (event - old_idx) < (uint16_t) (new_idx - old_idx);
+}
+
+// returns sent packets to the driver, the device never needs to interrupt us for that
+static void device_complete(struct virtqueue* vq, struct fake_device* device, uint16_t num) {
+	uint16_t old_used_idx = device->used_idx;
+	for (uint16_t i = 0; i < num; i++) {
+		uint16_t head = vq->vring.avail->ring[(uint16_t) (device->last_avail_idx + i) % RING_SIZE];
+		struct vring_used_elem* e = &vq->vring.used->ring[device->used_idx++ % RING_SIZE];
+		e->id = head;
+		e->len = 0;
+	}
+	device->last_avail_idx += num;
+	vq->vring.used->idx = device->used_idx;
+	if (event_passed(vring_used_event(&vq->vring), old_used_idx, device->used_idx)) {
+		error("used index moved from %u to %u over the used event %u, the device would interrupt us",
+			old_used_idx, device->used_idx, vring_used_event(&vq->vring));
+	}
+}
+
+// the edge cases of the comparison at the wrap-around, directly on the kick helper
+static void check_kick_wraparound() {
+	struct virtio_device* dev = create_device();
+	struct virtqueue* vq = dev->tx_queue;
+	const uint16_t old_idx = 0xFFFE;
+	const uint16_t new_idx = 0x0002;
+	const struct { uint16_t event; bool kick; } cases[] = {
+		{0xFFFD, false}, {0xFFFE, true}, {0xFFFF, true}, {0x0000, true}, {0x0001, true}, {0x0002, false}, {0x8000, false}
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+		vq->vring.avail->idx = new_idx;
+		vring_avail_event(&vq->vring) = cases[i].event;
+		set_reg16(dev->notify_base, 0, NO_KICK);
+		virtio_kick(dev, vq, 1, old_idx);
+		bool kicked = get_reg16(dev->notify_base, 0) != NO_KICK;
+		if (kicked != cases[i].kick) {
+			error("avail index 0x%04X -> 0x%04X with avail event 0x%04X: %s", old_idx, new_idx, cases[i].event,
+				kicked ? "unexpected kick" : "missing kick");
+		}
+	}
+}
+
+static void run() {
+	struct mempool* mempool = memory_allocate_mempool(POOL_SIZE, 2048);
+	struct virtio_device* dev = create_device();
+	struct virtqueue* vq = dev->tx_queue;
+	struct fake_device device = {
+		.last_avail_idx = START_IDX,
+		.used_idx = START_IDX,
+	};
+	uint32_t wraps = 0;
+	for (uint32_t iteration = 0; iteration < NUM_ITERATIONS; iteration++) {
+		// the device either waits for the next descriptor (idle) or is still busy and only wants a kick later on
+		uint16_t avail_idx = vq->vring.avail->idx;
+		uint16_t event = next_rand() % 4 ? avail_idx : avail_idx + next_rand() % (2 * RING_SIZE);
+		vring_avail_event(&vq->vring) = event;
+		struct pkt_buf* bufs[64];
+		uint32_t num_bufs = pkt_buf_alloc_batch(mempool, bufs, 1 + next_rand() % 64);
+		for (uint32_t i = 0; i < num_bufs; i++) {
+			bufs[i]->size = 60;
+			bufs[i]->pkt_len = 60;
+		}
+		set_reg16(dev->notify_base, 0, NO_KICK);
+		uint32_t sent = virtio_tx_batch(&dev->ixy, 0, bufs, num_bufs);
+		pkt_buf_free_batch(bufs + sent, num_bufs - sent);
+		uint16_t new_avail_idx = vq->vring.avail->idx;
+		if (new_avail_idx != (uint16_t) (avail_idx + sent)) {
+			error("sent %u packets, but the avail index moved from %u to %u", sent, avail_idx, new_avail_idx);
+		}
+		wraps += new_avail_idx < avail_idx;
+		uint16_t doorbell = get_reg16(dev->notify_base, 0);
+		bool expected = event_passed(event, avail_idx, new_avail_idx);
+		if (doorbell != (expected ? 1 : NO_KICK)) {
+			error("avail index 0x%04X -> 0x%04X with avail event 0x%04X: doorbell 0x%04X, %s", avail_idx, new_avail_idx,
+				event, doorbell, expected ? "expected a kick" : "expected no kick");
+		}
+		device.num_kicks += expected;
+		device.num_suppressed += sent && !expected;
+		// the device is sometimes slower than us, the ring fills up
+		if (next_rand() % 3) {
+			uint16_t pending = new_avail_idx - device.last_avail_idx;
+			device_complete(vq, &device, next_rand() % (pending + 1));
+		}
+	}
+	if (!device.num_kicks || !device.num_suppressed || wraps < 2) {
+		error("%lu kicks, %lu suppressed, %u wrap-arounds: not all cases were tested",
+			device.num_kicks, device.num_suppressed, wraps);
+	}
+	info("%lu kicks, %lu batches without kick, %u wrap-arounds of the avail index", device.num_kicks, device.num_suppressed, wraps);
+}
+
+int main() {
+	check_kick_wraparound();
+	run();
+	return 0;
+}